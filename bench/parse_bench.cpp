@@ -0,0 +1,115 @@
+// Times the parser, and the AST cache round trip, on generated functions of
+// a million terms (or the count given as the only argument):
+//   flat    def f(x) x + x + ... + x;
+//   mixed   one chain mixing the precedences of the builtin operators
+//   nested  a chain of x + (x + (... + x)) nested 1000 deep
+// The sources are the same on every run, so timings can be compared across
+// changes.
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "lexer.h"
+#include "parser.h"
+#include "serialize.h"
+
+namespace {
+
+constexpr unsigned kDefaultTerms = 1000000;
+constexpr unsigned kNestedDepth = 1000;
+
+std::string flatSource(unsigned terms) {
+  std::string src = "def f(x) x";
+  for (unsigned i = 1; i < terms; ++i) {
+    src += " + x";
+  }
+  return src + ";\n";
+}
+
+std::string mixedSource(unsigned terms) {
+  const char ops[] = {'+', '-', '*', '/', '%'};
+  // Fixed seed, so that every run parses the same source
+  uint32_t state = 1;
+  std::string src = "def f(x) x";
+  for (unsigned i = 1; i < terms; ++i) {
+    state = state * 1103515245 + 12345;
+    src += ' ';
+    src += ops[(state >> 16) % sizeof(ops)];
+    src += i % 2 ? " 2" : " x";
+  }
+  return src + ";\n";
+}
+
+std::string nestedSource(unsigned terms) {
+  std::string src = "def f(x) x";
+  unsigned open = 0;
+  for (unsigned i = 1; i < terms; ++i) {
+    if (open + 1 < kNestedDepth) {
+      src += " + (x";
+      ++open;
+    } else {
+      src.append(open, ')');
+      src += " + x";
+      open = 0;
+    }
+  }
+  src.append(open, ')');
+  return src + ";\n";
+}
+
+double millisSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+bool run(const char *name, const std::string &source) {
+  auto start = std::chrono::steady_clock::now();
+  std::istringstream input(source);
+  Lexer lexer(input);
+  Parser parser(lexer, name);
+  auto items = parser.parseAll();
+  double parseMs = millisSince(start);
+  size_t nodeBytes = BaseNode::liveBytes();
+  if (parser.hadError() || items.size() != 1) {
+    std::cerr << name << ": parse failed" << std::endl;
+    return false;
+  }
+
+  start = std::chrono::steady_clock::now();
+  uint64_t sourceHash = hashSource(source);
+  std::string data = serializeAst(items, sourceHash);
+  std::vector<FunctionNode::UPtr> cached;
+  if (!deserializeAst(data.data(), data.size(), sourceHash, cached)) {
+    std::cerr << name << ": AST cache round trip failed" << std::endl;
+    return false;
+  }
+  double cacheMs = millisSince(start);
+
+  std::cout << name << ": parse " << parseMs << " ms, cache round trip "
+            << cacheMs << " ms, " << nodeBytes / 1024 << " KiB of nodes"
+            << std::endl;
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  unsigned terms = kDefaultTerms;
+  if (argc > 1) {
+    terms = std::strtoul(argv[1], nullptr, 10);
+  }
+  if (argc > 2 || terms == 0) {
+    std::cerr << "usage: klc-parse-bench [terms]" << std::endl;
+    return 1;
+  }
+
+  bool ok = run("flat", flatSource(terms));
+  ok &= run("mixed", mixedSource(terms));
+  ok &= run("nested", nestedSource(terms));
+  return ok ? 0 : 1;
+}
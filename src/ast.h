@@ -1,18 +1,51 @@
 #ifndef AST_H
 #define AST_H
 
+#include "lexer.h"
 #include "visitor.h"
+#include <atomic>
 #include <cassert>
+#include <cstddef>
 #include <memory>
 #include <string>
 #include <vector>
 
+// Deepest expression nesting the parser builds. The passes over the AST
+// recurse into subexpressions, except down the lhs of chains of binary
+// operators, which they walk in a loop; this bounds the stack they take.
+constexpr unsigned kMaxExprDepth = 4096;
+
 // Abstract base class for all nodes
 class BaseNode {
 public:
   using UPtr = std::unique_ptr<BaseNode>;
   virtual ~BaseNode() = default;
   virtual void accept(Visitor &visitor) = 0;
+
+  SourceLocation loc() const { return loc_; }
+  void setLoc(SourceLocation loc) { loc_ = loc; }
+
+  // Bytes taken by the nodes alive, not counting the strings and vectors
+  // they own
+  static size_t liveBytes() { return liveBytesCounter(); }
+
+  static void *operator new(size_t size) {
+    liveBytesCounter() += size;
+    return ::operator new(size);
+  }
+  static void operator delete(void *ptr, size_t size) {
+    liveBytesCounter() -= size;
+    ::operator delete(ptr);
+  }
+
+private:
+  // Files are parsed on several threads
+  static std::atomic<size_t> &liveBytesCounter() {
+    static std::atomic<size_t> counter{0};
+    return counter;
+  }
+
+  SourceLocation loc_;
 };
 
 // Base class for all expression nodes
@@ -20,6 +53,24 @@ class ExprNode : public BaseNode {
 public:
   using UPtr = std::unique_ptr<ExprNode>;
   void accept(Visitor &visitor) override { visitor.visit(*this); }
+
+protected:
+  // Move the subexpressions of the node to `children`
+  virtual void takeChildren(std::vector<ExprNode::UPtr> &children) {}
+
+  // Destroy the subexpressions without recursing over the depth of the
+  // tree, which can be as deep as the source expression is long
+  void destroyChildren() {
+    std::vector<ExprNode::UPtr> children;
+    takeChildren(children);
+    while (!children.empty()) {
+      ExprNode::UPtr child = std::move(children.back());
+      children.pop_back();
+      if (child) {
+        child->takeChildren(children);
+      }
+    }
+  }
 };
 
 class NumberExprNode : public ExprNode {
@@ -54,13 +105,14 @@ public:
     mul,
     div,
     mod,
+    // User defined operator, a call to the function "binary<opChar>"
+    custom,
   };
 
-  BinaryExprNode(Op op, ExprNode::UPtr lhs, ExprNode::UPtr rhs)
-      : op_(op), lhs_(std::move(lhs)), rhs_(std::move(rhs)) {}
-  BinaryExprNode(int opc, ExprNode::UPtr lhs, ExprNode::UPtr rhs)
-      : op_(plus), lhs_(std::move(lhs)), rhs_(std::move(rhs)) {
-    switch (opc) {
+  BinaryExprNode(char opChar, ExprNode::UPtr lhs, ExprNode::UPtr rhs)
+      : op_(custom), opChar_(opChar), lhs_(std::move(lhs)),
+        rhs_(std::move(rhs)) {
+    switch (opChar) {
     case '+':
       op_ = plus;
       break;
@@ -76,34 +128,60 @@ public:
     case '%':
       op_ = mod;
       break;
-    default:
-      assert(false && "invalid binary op");
-      break;
     }
   }
+  ~BinaryExprNode() override { destroyChildren(); }
 
   Op op() const { return op_; }
+  char opChar() const { return opChar_; }
   ExprNode *lhs() const { return lhs_.get(); }
   ExprNode *rhs() const { return rhs_.get(); }
 
   void accept(Visitor &visitor) override { visitor.visit(*this); }
 
+protected:
+  void takeChildren(std::vector<ExprNode::UPtr> &children) override {
+    children.push_back(std::move(lhs_));
+    children.push_back(std::move(rhs_));
+  }
+
 private:
   Op op_;
+  char opChar_;
   ExprNode::UPtr lhs_;
   ExprNode::UPtr rhs_;
 };
 
+// `binExpr` and the binary expressions down its lhs, outermost first. A
+// chain of left associative operators is as deep as it is long, so the
+// passes walk it with this rather than recursing into each lhs.
+inline std::vector<BinaryExprNode *> lhsChain(BinaryExprNode &binExpr) {
+  std::vector<BinaryExprNode *> chain{&binExpr};
+  while (auto *lhs = dynamic_cast<BinaryExprNode *>(chain.back()->lhs())) {
+    chain.push_back(lhs);
+  }
+  return chain;
+}
+
 class CallExprNode : public ExprNode {
 public:
   CallExprNode(std::string callee, std::vector<ExprNode::UPtr> args)
       : callee_(std::move(callee)), args_(std::move(args)) {}
 
+  ~CallExprNode() override { destroyChildren(); }
+
   std::string callee() const { return callee_; }
   const std::vector<ExprNode::UPtr> &args() const { return args_; }
 
   void accept(Visitor &visitor) override { visitor.visit(*this); }
 
+protected:
+  void takeChildren(std::vector<ExprNode::UPtr> &children) override {
+    for (auto &arg : args_) {
+      children.push_back(std::move(arg));
+    }
+  }
+
 private:
   std::string callee_;
   std::vector<ExprNode::UPtr> args_;
@@ -116,32 +194,86 @@ public:
       : condExpr_(std::move(condExpr)), thenExpr_(std::move(thenExpr)),
         elseExpr_(std::move(elseExpr)) {}
 
+  ~IfElseExprNode() override { destroyChildren(); }
+
   ExprNode *condExpr() const { return condExpr_.get(); }
   ExprNode *thenExpr() const { return thenExpr_.get(); }
   ExprNode *elseExpr() const { return elseExpr_.get(); }
 
   void accept(Visitor &visitor) override { visitor.visit(*this); }
 
+protected:
+  void takeChildren(std::vector<ExprNode::UPtr> &children) override {
+    children.push_back(std::move(condExpr_));
+    children.push_back(std::move(thenExpr_));
+    children.push_back(std::move(elseExpr_));
+  }
+
 private:
   ExprNode::UPtr condExpr_;
   ExprNode::UPtr thenExpr_;
   ExprNode::UPtr elseExpr_;
 };
 
+// Element of a buffer param, `buffer[index]`, or an assignment to it,
+// `buffer[index] = value`, whose value is the assigned value
+class IndexExprNode : public ExprNode {
+public:
+  IndexExprNode(std::string buffer, ExprNode::UPtr index,
+                ExprNode::UPtr value = nullptr)
+      : buffer_(std::move(buffer)), index_(std::move(index)),
+        value_(std::move(value)) {}
+  ~IndexExprNode() override { destroyChildren(); }
+
+  const std::string &buffer() const { return buffer_; }
+  ExprNode *index() const { return index_.get(); }
+  // Null when the element is read
+  ExprNode *value() const { return value_.get(); }
+
+  void accept(Visitor &visitor) override { visitor.visit(*this); }
+
+protected:
+  void takeChildren(std::vector<ExprNode::UPtr> &children) override {
+    children.push_back(std::move(index_));
+    children.push_back(std::move(value_));
+  }
+
+private:
+  std::string buffer_;
+  ExprNode::UPtr index_;
+  ExprNode::UPtr value_;
+};
+
 class FunctionNode : public BaseNode {
 public:
   FunctionNode(bool isDecl, std::string name, std::vector<std::string> args,
-               ExprNode::UPtr body)
+               ExprNode::UPtr body, std::vector<bool> bufferParams = {})
       : isDecl_(isDecl), name_(std::move(name)), args_(std::move(args)),
-        body_(std::move(body)) {}
+        body_(std::move(body)), bufferParams_(std::move(bufferParams)) {
+    bufferParams_.resize(args_.size());
+  }
 
   using UPtr = std::unique_ptr<FunctionNode>;
 
   bool isDecl() const { return isDecl_; }
   std::string name() const { return name_; }
   const std::vector<std::string> &args() const { return args_; }
+  // Buffer params (`name[]`) are passed as a pointer to doubles and a length
+  bool isBufferParam(size_t i) const { return bufferParams_[i]; }
+  const std::vector<bool> &bufferParams() const { return bufferParams_; }
   ExprNode *body() const { return body_.get(); }
 
+  // Precedence of the binary operator a `binary<op>` function defines, 0 for
+  // other functions
+  int precedence() const { return precedence_; }
+  void setPrecedence(int precedence) { precedence_ = precedence; }
+
+  // Name of the source file the function was read from
+  const std::string &sourceName() const { return sourceName_; }
+  void setSourceName(std::string sourceName) {
+    sourceName_ = std::move(sourceName);
+  }
+
   void accept(Visitor &visitor) override { visitor.visit(*this); }
 
 private:
@@ -149,6 +281,9 @@ private:
   std::string name_;
   std::vector<std::string> args_;
   ExprNode::UPtr body_;
+  std::vector<bool> bufferParams_;
+  int precedence_ = 0;
+  std::string sourceName_;
 };
 
 #endif // AST_H
@@ -1,15 +1,35 @@
 #include "codegen.h"
+#include "specialize.h"
+#include <algorithm>
 #include <exception>
+#include <fstream>
 #include <iostream>
+#include <limits>
 #include <llvm/ADT/APFloat.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/DebugInfoMetadata.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/MC/SubtargetFeature.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Pass.h>
+#include <llvm/ProfileData/InstrProf.h>
+#include <llvm/ProfileData/ProfileCommon.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/TargetSelect.h>
 #include <llvm/Transforms/InstCombine/InstCombine.h>
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/Scalar/GVN.h>
+#include <llvm/Transforms/Utils/ModuleUtils.h>
+#include <llvm/Transforms/Vectorize.h>
 #include <sstream>
 
 using namespace llvm;
@@ -18,9 +38,143 @@ void logError(const std::string &err) {
   std::cerr << "error: " << err << std::endl;
 }
 
+namespace {
+
+// Counts if/then/else expressions of a function body, which determines the
+// number of profile counters the function needs.
+class BranchCounter : public Visitor {
+public:
+  unsigned count() const { return count_; }
+
+  void visit(ExprNode &exprNode) override { assert(false); }
+  void visit(NumberExprNode &numExpr) override {}
+  void visit(VariableExprNode &varExpr) override {}
+  void visit(BinaryExprNode &binExpr) override {
+    auto chain = lhsChain(binExpr);
+    chain.back()->lhs()->accept(*this);
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+      (*it)->rhs()->accept(*this);
+    }
+  }
+  void visit(CallExprNode &callExpr) override {
+    for (const auto &arg : callExpr.args()) {
+      arg->accept(*this);
+    }
+  }
+  void visit(IndexExprNode &indexExpr) override {
+    indexExpr.index()->accept(*this);
+    if (indexExpr.value()) {
+      indexExpr.value()->accept(*this);
+    }
+  }
+  void visit(IfElseExprNode &ifelseExpr) override {
+    ++count_;
+    ifelseExpr.condExpr()->accept(*this);
+    ifelseExpr.thenExpr()->accept(*this);
+    ifelseExpr.elseExpr()->accept(*this);
+  }
+  void visit(FunctionNode &funcNode) override {
+    if (funcNode.body()) {
+      funcNode.body()->accept(*this);
+    }
+  }
+
+private:
+  unsigned count_ = 0;
+};
+
+// libm functions which have an equivalent LLVM intrinsic
+struct MathBuiltin {
+  const char *name;
+  unsigned numArgs;
+  Intrinsic::ID id;
+};
+
+const MathBuiltin kMathBuiltins[] = {
+    {"sin", 1, Intrinsic::sin},       {"cos", 1, Intrinsic::cos},
+    {"exp", 1, Intrinsic::exp},       {"exp2", 1, Intrinsic::exp2},
+    {"log", 1, Intrinsic::log},       {"log2", 1, Intrinsic::log2},
+    {"log10", 1, Intrinsic::log10},   {"sqrt", 1, Intrinsic::sqrt},
+    {"pow", 2, Intrinsic::pow},       {"fabs", 1, Intrinsic::fabs},
+    {"floor", 1, Intrinsic::floor},   {"ceil", 1, Intrinsic::ceil},
+    {"fmin", 2, Intrinsic::minnum},   {"fmax", 2, Intrinsic::maxnum},
+};
+
+// Returns the intrinsic implementing extern function `name`, or
+// Intrinsic::not_intrinsic if it is not a known libm function.
+Intrinsic::ID getMathIntrinsic(StringRef name, unsigned numArgs) {
+  for (const auto &builtin : kMathBuiltins) {
+    if (name == builtin.name && numArgs == builtin.numArgs) {
+      return builtin.id;
+    }
+  }
+  return Intrinsic::not_intrinsic;
+}
+
+// Branch weights of the overflow checks of integer arithmetic, as those of
+// __builtin_expect
+MDNode *overflowWeights(LLVMContext &context) {
+  return MDBuilder(context).createBranchWeights(1, 2000);
+}
+
+} // namespace
+
+void Codegen::setupTargetMachine() {
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+
+  std::string triple = sys::getProcessTriple();
+  std::string err;
+  const Target *target = TargetRegistry::lookupTarget(triple, err);
+  if (!target) {
+    logError(err);
+    std::abort();
+  }
+
+  SubtargetFeatures features;
+  StringMap<bool> hostFeatures;
+  if (sys::getHostCPUFeatures(hostFeatures)) {
+    for (const auto &feature : hostFeatures) {
+      features.AddFeature(feature.first(), feature.second);
+    }
+  }
+
+  targetMachine_.reset(target->createTargetMachine(
+      triple, sys::getHostCPUName(), features.getString(), TargetOptions(),
+      Reloc::PIC_));
+}
+
+void Codegen::newModule() {
+  theModule_ = std::make_unique<Module>("my first module", llvmContext_);
+  theModule_->setTargetTriple(targetMachine_->getTargetTriple().str());
+  theModule_->setDataLayout(jit_ ? jit_->getDataLayout()
+                                 : targetMachine_->createDataLayout());
+  if (profileSummary_) {
+    theModule_->setProfileSummary(profileSummary_, ProfileSummary::PSK_Instr);
+  }
+
+  if (options_.debugInfo) {
+    theModule_->addModuleFlag(Module::Warning, "Debug Info Version",
+                              DEBUG_METADATA_VERSION);
+    theModule_->addModuleFlag(Module::Warning, "Dwarf Version", 4);
+    debugBuilder_ = std::make_unique<DIBuilder>(*theModule_);
+    debugUnit_ = nullptr;
+  }
+
+  setupFunctionPassManager();
+}
+
 void Codegen::setupFunctionPassManager() {
   theFPM_ = std::make_unique<legacy::FunctionPassManager>(theModule_.get());
 
+  // Target cost model and library functions (including the vector math
+  // library) used by the vectorizers
+  TargetLibraryInfoImpl tlii(targetMachine_->getTargetTriple());
+  tlii.addVectorizableFunctionsFromVecLib(options_.vecLib);
+  theFPM_->add(new TargetLibraryInfoWrapperPass(tlii));
+  theFPM_->add(
+      createTargetTransformInfoWrapperPass(targetMachine_->getTargetIRAnalysis()));
+
   // "peephole" and bit-twiddling optimizations
   theFPM_->add(createInstructionCombiningPass());
   // Reassociate expressions
@@ -29,6 +183,14 @@ void Codegen::setupFunctionPassManager() {
   theFPM_->add(createGVNPass());
   // Simplify CFG (delete unreachable blocks, etc.)
   theFPM_->add(createCFGSimplificationPass());
+  // Turn self recursion in tail position (the only way to loop over a
+  // buffer) into loops
+  theFPM_->add(createTailCallEliminationPass());
+  // Vectorize loops and straight-line code (math intrinsics are mapped to
+  // the vector math library)
+  theFPM_->add(createLoopVectorizePass());
+  theFPM_->add(createSLPVectorizerPass());
+  theFPM_->add(createInstructionCombiningPass());
 
   theFPM_->doInitialization();
 }
@@ -36,6 +198,11 @@ void Codegen::setupFunctionPassManager() {
 void Codegen::visit(ExprNode &exprNode) { assert(false); }
 
 void Codegen::visit(NumberExprNode &numExpr) {
+  if (isInteger(numExpr)) {
+    valStack_.emplace_front(ConstantInt::get(
+        Type::getInt64Ty(llvmContext_), int64_t(numExpr.num()), true));
+    return;
+  }
   valStack_.emplace_front(
       ConstantFP::get(llvmContext_, APFloat(numExpr.num())));
 }
@@ -48,22 +215,109 @@ void Codegen::visit(VariableExprNode &varExpr) {
     logError(ostr.str());
     return;
   }
-  valStack_.emplace_front(symTable_[varName]);
+  Value *val = symTable_[varName];
+  if (val->getType()->isPointerTy()) {
+    logError("buffer '" + varName + "' used as a value");
+    return;
+  }
+  valStack_.emplace_front(val);
 }
 
 void Codegen::visit(BinaryExprNode &binExpr) {
-  binExpr.lhs()->accept(*this);
+  // Walk down the lhs of the chain of operators to the first value already
+  // computed, then emit the operators above it innermost first
+  auto chain = lhsChain(binExpr);
+  size_t numPending = 0;
+  while (numPending < chain.size() && !reuseSubexpr(*chain[numPending])) {
+    ++numPending;
+  }
+  if (numPending == 0) {
+    return;
+  }
+
+  // Run an expensive call on the lhs as a task while the rhs is evaluated
+  Task lhsTask;
+  if (numPending == chain.size()) {
+    BinaryExprNode &innermost = *chain.back();
+    if (taskCosts_ &&
+        taskCosts_->shouldSpawn(*innermost.lhs(),
+                                taskCosts_->cost(*innermost.rhs()))) {
+      lhsTask = spawnCall(static_cast<CallExprNode &>(*innermost.lhs()));
+      if (!lhsTask.frame) {
+        return;
+      }
+    } else {
+      innermost.lhs()->accept(*this);
+    }
+  }
+  for (size_t i = numPending; i-- > 0;) {
+    if (!emitBinaryExpr(*chain[i], lhsTask)) {
+      return;
+    }
+    lhsTask = Task();
+  }
+}
+
+// Emits binExpr whose lhs is on top of the stack, or runs as lhsTask
+bool Codegen::emitBinaryExpr(BinaryExprNode &binExpr, const Task &lhsTask) {
+  size_t numVals = valStack_.size();
   binExpr.rhs()->accept(*this);
+  if (lhsTask.frame) {
+    // The stack may hold the values of enclosing expressions
+    if (valStack_.size() == numVals) {
+      return false;
+    }
+    valStack_.insert(valStack_.begin() + 1, joinTask(lhsTask));
+  }
   if (valStack_.size() < 2) {
-    return;
+    return false;
   }
 
-  Value *lhs = valStack_.front();
-  valStack_.pop_front();
+  // rhs was pushed last, so it is on top of the stack
   Value *rhs = valStack_.front();
   valStack_.pop_front();
+  Value *lhs = valStack_.front();
+  valStack_.pop_front();
 
+  emitLocation(binExpr);
   Value *result = nullptr;
+  if (isInteger(binExpr)) {
+    // Only an integer version has +, - and * on integers (see
+    // IntegerInference), which return kIntegerOverflow when the result
+    // leaves the exact range
+    switch (binExpr.op()) {
+    case BinaryExprNode::Op::plus:
+      result = emitIntegerOp(Intrinsic::sadd_with_overflow, lhs, rhs,
+                             "addtmp");
+      break;
+    case BinaryExprNode::Op::minus:
+      result = emitIntegerOp(Intrinsic::ssub_with_overflow, lhs, rhs,
+                             "subtmp");
+      break;
+    case BinaryExprNode::Op::mul:
+      result = emitIntegerOp(Intrinsic::smul_with_overflow, lhs, rhs,
+                             "multmp");
+      break;
+    case BinaryExprNode::Op::mod:
+      // Smaller than lhs
+      result = builder_.CreateSRem(lhs, rhs, "remtmp");
+      break;
+    case BinaryExprNode::Op::custom:
+      result = checkIntegerResult(builder_.CreateCall(
+          getFunction(std::string("binary") + binExpr.opChar() +
+                      kIntegerSuffix),
+          {lhs, rhs}, "binop"));
+      break;
+    default:
+      assert(false && "division is never an integer");
+    }
+    recordSubexpr(binExpr, result);
+    valStack_.emplace_front(result);
+    return true;
+  }
+
+  lhs = toDouble(lhs);
+  rhs = toDouble(rhs);
   switch (binExpr.op()) {
   case BinaryExprNode::Op::plus:
     result = builder_.CreateFAdd(lhs, rhs, "addtmp");
@@ -74,51 +328,163 @@ void Codegen::visit(BinaryExprNode &binExpr) {
   case BinaryExprNode::Op::mul:
     result = builder_.CreateFMul(lhs, rhs, "multmp");
     break;
+  case BinaryExprNode::Op::div:
+    result = builder_.CreateFDiv(lhs, rhs, "divtmp");
+    break;
+  case BinaryExprNode::Op::mod:
+    result = builder_.CreateFRem(lhs, rhs, "remtmp");
+    break;
+  case BinaryExprNode::Op::custom: {
+    Function *func = getFunction(std::string("binary") + binExpr.opChar());
+    if (!func || func->arg_size() != 2) {
+      logError("error: unknown binary operator");
+      return false;
+    }
+    result = builder_.CreateCall(func, {lhs, rhs}, "binop");
+  } break;
   default:
     logError("error: invalid binary operator");
+    return false;
   }
 
+  recordSubexpr(binExpr, result);
   valStack_.emplace_front(result);
+  return true;
 }
 
 void Codegen::visit(CallExprNode &callExpr) {
+  if (callExpr.callee() == "len" && callExpr.args().size() == 1) {
+    Value *len;
+    if (getBuffer(*callExpr.args()[0], len)) {
+      valStack_.emplace_front(isInteger(callExpr) ? len : toDouble(len));
+      return;
+    }
+  }
+
   // Lookup called function name in llvm module table
-  Function *func = theModule_->getFunction(callExpr.callee());
+  Function *func = getFunction(callExpr.callee());
   if (!func) {
     logError("error: called unknown function");
     return;
   }
 
-  if (func->arg_size() != callExpr.args().size()) {
+  // A buffer arg is passed as a pointer and a length
+  unsigned numParams = func->arg_size();
+  for (const Argument &arg : func->args()) {
+    numParams -= arg.getType()->isPointerTy();
+  }
+  if (numParams != callExpr.args().size()) {
     logError("error: incorrect number of args passed in function call");
     return;
   }
 
+  bool integer = intInference_ && intInference_->callsIntegerVersion(callExpr);
+  Function *doubleFunc = func;
+  if (integer) {
+    func = getFunction(callExpr.callee() + kIntegerSuffix);
+  }
+
+  // Call well-known libm externs through their intrinsic, so they can be
+  // constant folded and vectorized.
+  if (func->isDeclaration()) {
+    Intrinsic::ID id = getMathIntrinsic(func->getName(), func->arg_size());
+    if (id != Intrinsic::not_intrinsic) {
+      func = Intrinsic::getDeclaration(theModule_.get(), id,
+                                       {Type::getDoubleTy(llvmContext_)});
+    }
+  }
+
+  // Expensive calls among the args run as tasks while the args after them
+  // are evaluated
+  const auto &args = callExpr.args();
+  std::vector<unsigned> restCosts(args.size(), 0);
+  for (size_t i = args.size(); taskCosts_ && i-- > 1;) {
+    restCosts[i - 1] = addCost(restCosts[i], taskCosts_->cost(*args[i]));
+  }
+  std::vector<std::pair<size_t, Task>> tasks;
+  // Buffer params are noalias, a buffer can only be passed once
+  std::vector<Value *> buffers;
+
   std::vector<Value *> argsV;
-  for (const auto &arg : callExpr.args()) {
+  for (size_t i = 0; i < args.size(); ++i) {
+    const auto &arg = args[i];
+    if (func->getArg(argsV.size())->getType()->isPointerTy()) {
+      Value *len;
+      Value *buffer = getBuffer(*arg, len);
+      if (!buffer) {
+        logError("expected a buffer argument");
+        return;
+      }
+      if (std::find(buffers.begin(), buffers.end(), buffer) !=
+          buffers.end()) {
+        logError("buffer '" + buffer->getName().str() +
+                 "' passed to several buffer params of '" +
+                 callExpr.callee() + "'");
+        return;
+      }
+      buffers.push_back(buffer);
+      argsV.push_back(buffer);
+      argsV.push_back(len);
+      continue;
+    }
+
+    if (taskCosts_ && taskCosts_->shouldSpawn(*arg, restCosts[i])) {
+      Task task = spawnCall(static_cast<CallExprNode &>(*arg));
+      if (!task.frame) {
+        return;
+      }
+      tasks.emplace_back(argsV.size(), task);
+      argsV.push_back(nullptr);
+      continue;
+    }
+
     arg->accept(*this);
     if (valStack_.empty()) {
       return;
     }
-    argsV.emplace_back(valStack_.front());
+    argsV.emplace_back(integer ? valStack_.front()
+                               : toDouble(valStack_.front()));
     valStack_.pop_front();
   }
 
-  valStack_.emplace_front(
-      builder_.CreateCall(func, std::move(argsV), "calltmp"));
+  // Newest first, which is likely still queued on this thread
+  for (auto it = tasks.rbegin(); it != tasks.rend(); ++it) {
+    Value *val = joinTask(it->second);
+    argsV[it->first] = integer ? val : toDouble(val);
+  }
+
+  emitLocation(callExpr);
+  Value *result = builder_.CreateCall(func, argsV, "calltmp");
+  if (integer) {
+    result = isInteger(callExpr)
+                 ? checkIntegerResult(result)
+                 : emitOverflowFallback(doubleFunc, argsV, result);
+  }
+  valStack_.emplace_front(result);
 }
 
 void Codegen::visit(IfElseExprNode &ifelseExpr) {
+  if (reuseSubexpr(ifelseExpr)) {
+    return;
+  }
+
   ifelseExpr.condExpr()->accept(*this);
   if (valStack_.empty()) {
     return;
   }
 
   // Convert cond expr to bool by comparing with 0.0 (x != 0.0)
+  emitLocation(ifelseExpr);
   Value *condVal = valStack_.front();
   valStack_.pop_front();
-  condVal = builder_.CreateFCmpONE(
-      condVal, ConstantFP::get(llvmContext_, APFloat(0.0)), "ifcond");
+  if (condVal->getType()->isIntegerTy()) {
+    condVal = builder_.CreateICmpNE(
+        condVal, ConstantInt::get(condVal->getType(), 0), "ifcond");
+  } else {
+    condVal = builder_.CreateFCmpONE(
+        condVal, ConstantFP::get(llvmContext_, APFloat(0.0)), "ifcond");
+  }
+  bool integer = isInteger(ifelseExpr);
 
   // Get Function in which we want to add BB for then, else and ifcont.
   Function *fun = builder_.GetInsertBlock()->getParent();
@@ -131,17 +497,31 @@ void Codegen::visit(IfElseExprNode &ifelseExpr) {
   BasicBlock *elseBB = BasicBlock::Create(llvmContext_, "else");
   BasicBlock *ifContBB = BasicBlock::Create(llvmContext_, "ifcont");
 
+  // Reserve then and else profile counters before visiting nested ifs
+  unsigned thenSlot = nextProfSlot_;
+  nextProfSlot_ += 2;
+
   // Create conditional branch
-  builder_.CreateCondBr(condVal, thenBB, elseBB);
+  BranchInst *br = builder_.CreateCondBr(condVal, thenBB, elseBB);
+  setBranchWeights(br, thenSlot);
+
+  // Values generated in one branch are not available in the other one, nor
+  // after the branches merge
+  size_t subexprScope = subexprLog_.size();
 
   // Emit then code in thenBB
   builder_.SetInsertPoint(thenBB);
+  emitProfileIncrement(thenSlot);
   ifelseExpr.thenExpr()->accept(*this);
+  popSubexprScope(subexprScope);
   if (valStack_.empty()) {
     return;
   }
   Value *thenVal = valStack_.front();
   valStack_.pop_front();
+  if (!integer) {
+    thenVal = toDouble(thenVal);
+  }
   builder_.CreateBr(ifContBB);
   // codegen for then could change the current block,
   // get then predecessor for phi
@@ -151,12 +531,17 @@ void Codegen::visit(IfElseExprNode &ifelseExpr) {
   // Insert elseBB into fun
   fun->getBasicBlockList().push_back(elseBB);
   builder_.SetInsertPoint(elseBB);
+  emitProfileIncrement(thenSlot + 1);
   ifelseExpr.elseExpr()->accept(*this);
+  popSubexprScope(subexprScope);
   if (valStack_.empty()) {
     return;
   }
   Value *elseVal = valStack_.front();
   valStack_.pop_front();
+  if (!integer) {
+    elseVal = toDouble(elseVal);
+  }
   builder_.CreateBr(ifContBB);
   // codegen for else could change the current block,
   // get else predecessor for phi
@@ -165,54 +550,212 @@ void Codegen::visit(IfElseExprNode &ifelseExpr) {
   // Emit if cont. code
   fun->getBasicBlockList().push_back(ifContBB);
   builder_.SetInsertPoint(ifContBB);
-  PHINode *phiNode =
-      builder_.CreatePHI(Type::getDoubleTy(llvmContext_), 2, "iftmp");
+  emitLocation(ifelseExpr);
+  PHINode *phiNode = builder_.CreatePHI(thenVal->getType(), 2, "iftmp");
   phiNode->addIncoming(thenVal, thenPredBB);
   phiNode->addIncoming(elseVal, elsePredBB);
 
+  recordSubexpr(ifelseExpr, phiNode);
   valStack_.emplace_front(phiNode);
 }
 
-void Codegen::visit(FunctionNode &funcNode) {
-  Function *fun = theModule_->getFunction(funcNode.name());
-
-  if (!fun || funcNode.isDecl()) {
-    // Create function type double(double, double,...)
-    // last arg flase means it's not a vararg function
-    std::vector<Type *> doubles(funcNode.args().size(),
-                                Type::getDoubleTy(llvmContext_));
-    FunctionType *ft = FunctionType::get(Type::getDoubleTy(llvmContext_),
-                                         std::move(doubles), false);
+void Codegen::visit(IndexExprNode &indexExpr) {
+  auto it = symTable_.find(indexExpr.buffer());
+  if (it == symTable_.end() || !it->second->getType()->isPointerTy()) {
+    logError("unknown buffer '" + indexExpr.buffer() + "'");
+    return;
+  }
+  Value *buffer = it->second;
 
-    // Create function of type ft and insert it into theModule_ llvm module
-    fun = Function::Create(ft, Function::ExternalLinkage, funcNode.name(),
-                           theModule_.get());
+  indexExpr.index()->accept(*this);
+  if (valStack_.empty()) {
+    return;
+  }
+  Value *index = valStack_.front();
+  valStack_.pop_front();
+  Type *int64Ty = Type::getInt64Ty(llvmContext_);
+  if (!index->getType()->isIntegerTy()) {
+    index = builder_.CreateFPToSI(index, int64Ty, "index");
+  }
 
-    // Give each arg of Function fun a name
-    unsigned i = 0;
-    for (auto &arg : fun->args()) {
-      arg.setName(funcNode.args()[i++]);
+  Value *value = nullptr;
+  if (indexExpr.value()) {
+    indexExpr.value()->accept(*this);
+    if (valStack_.empty()) {
+      return;
     }
+    value = valStack_.front();
+    valStack_.pop_front();
+  }
 
+  // Indices are not checked against the buffer length
+  emitLocation(indexExpr);
+  Type *doubleTy = Type::getDoubleTy(llvmContext_);
+  Value *elem = builder_.CreateInBoundsGEP(doubleTy, buffer, index, "elem");
+  if (value) {
+    builder_.CreateAlignedStore(toDouble(value), elem, Align(8));
+    valStack_.emplace_front(value);
   } else {
-    // TODO: check if function signature matches with prototype declared before
+    valStack_.emplace_front(
+        builder_.CreateAlignedLoad(doubleTy, elem, Align(8), "elemval"));
+  }
+}
+
+void Codegen::visit(FunctionNode &funcNode) {
+  // In JIT mode top-level expressions need a name to be looked up by
+  std::string name = funcNode.name();
+  if (jit_ && !funcNode.isDecl()) {
+    // Each function gets its own module, so that the JIT can free the code
+    // of top-level expressions once evaluated and evict cold functions
+    flushModule();
+    if (name.empty()) {
+      name = "__anon_expr." + std::to_string(numExprs_++);
+    }
+  }
+
+  Function *fun = getFunction(name);
+  Type *doubleTy = Type::getDoubleTy(llvmContext_);
+
+  if (!fun) {
+    fun = createFunction(name, funcNode, doubleTy);
+  } else if (fun->getFunctionType() !=
+             getFunctionType(funcNode.bufferParams(), doubleTy)) {
+    return logError("function '" + funcNode.name() +
+                    "' declared with different params");
+  }
+
+  if (!funcNode.name().empty()) {
+    protos_[name] = fun->getFunctionType();
+  }
+
+  if (funcNode.precedence()) {
+    binaryOps_[name.back()] = funcNode.precedence();
   }
 
   lastFn_ = fun;
   if (funcNode.isDecl()) {
+    // libm functions are pure
+    if (parallelCallsEnabled()) {
+      taskInfos_.emplace(
+          name, TaskInfo{getMathIntrinsic(name, funcNode.args().size()) !=
+                         Intrinsic::not_intrinsic});
+    }
     return;
   }
 
-  if (!fun->empty()) {
+  if (definedFns_.count(name) || !fun->empty()) {
+    lastFn_ = nullptr;
     return logError("function cannot be redefined");
   }
 
+  // The definition's arg names are the ones its body refers to
+  nameArgs(fun, funcNode);
+
+  if (parallelCallsEnabled() && !funcNode.name().empty()) {
+    analyzeTaskInfo(funcNode, taskInfos_);
+  }
+
+  std::string bodyKey;
+  if (dedupEnabled() && !funcNode.name().empty()) {
+    bodyKey = canonicalForm(funcNode);
+    auto it = bodies_.find(bodyKey);
+    if (it != bodies_.end()) {
+      definedFns_.insert(name);
+      Function *orig = getFunction(it->second);
+      if (!orig->isDeclaration()) {
+        // Same body as an earlier function up to parameter names: make
+        // this one an alias of it.
+        auto *alias = GlobalAlias::create(GlobalValue::ExternalLinkage, "",
+                                          orig);
+        fun->replaceAllUsesWith(alias);
+        fun->eraseFromParent();
+        alias->setName(name);
+        lastFn_ = nullptr;
+        return;
+      }
+
+      // The original was already handed over to the JIT, aliases cannot
+      // cross modules: forward to it instead.
+      builder_.SetInsertPoint(BasicBlock::Create(llvmContext_, "entry", fun));
+      std::vector<Value *> args;
+      for (auto &arg : fun->args()) {
+        args.push_back(&arg);
+      }
+      CallInst *call = builder_.CreateCall(orig, args, "calltmp");
+      call->setTailCall();
+      builder_.CreateRet(call);
+      verifyFunction(*fun);
+      return;
+    }
+  }
+
+  if (options_.integerInference &&
+      inferIntegerVersion(funcNode, integerFns_)) {
+    emitIntegerVersion(funcNode);
+  }
+
+  if (emitFunctionBody(fun, funcNode)) {
+    if (!bodyKey.empty()) {
+      bodies_[bodyKey] = name;
+    }
+    if (funcNode.name().empty()) {
+      lastExprName_ = name;
+    } else {
+      definedFns_.insert(name);
+    }
+    return;
+  }
+
+  // Error in generating body, remove function
+  fun->eraseFromParent();
+  lastFn_ = nullptr;
+}
+
+void Codegen::emitIntegerVersion(FunctionNode &funcNode) {
+  std::string name = funcNode.name() + kIntegerSuffix;
+  Type *int64Ty = Type::getInt64Ty(llvmContext_);
+  Function *fun = getFunction(name);
+  if (!fun) {
+    fun = createFunction(name, funcNode, int64Ty);
+  }
+  protos_[name] = fun->getFunctionType();
+  nameArgs(fun, funcNode);
+
+  if (!emitFunctionBody(fun, funcNode)) {
+    fun->eraseFromParent();
+    protos_.erase(name);
+    integerFns_.erase(funcNode.name());
+  }
+}
+
+// Generates the body of `fun`, the double or the integer version of
+// funcNode depending on its return type
+bool Codegen::emitFunctionBody(Function *fun, FunctionNode &funcNode) {
   // Create a basic block and add it at the end of Function fun.
   BasicBlock *bb = BasicBlock::Create(llvmContext_, "entry", fun);
 
   // Tell builder to insert new instructions into this new BB
   builder_.SetInsertPoint(bb);
 
+  DISubprogram *subprogram = beginDebugFunction(fun, funcNode);
+
+  beginFunctionProfile(fun, funcNode);
+
+  if (dedupEnabled()) {
+    hasher_ = std::make_unique<StructuralHasher>(funcNode.args());
+    funcNode.accept(*hasher_);
+  }
+
+  bool integer = fun->getReturnType()->isIntegerTy();
+  overflowBB_ = nullptr;
+  if (options_.integerInference) {
+    intInference_ =
+        std::make_unique<IntegerInference>(integerFns_, funcNode, integer);
+  }
+  if (parallelCallsEnabled()) {
+    taskCosts_ = std::make_unique<TaskCostModel>(taskInfos_, funcNode);
+  }
+
   symTable_.clear();
   for (auto &arg : fun->args()) {
     symTable_[std::string(arg.getName())] = &arg;
@@ -220,21 +763,835 @@ void Codegen::visit(FunctionNode &funcNode) {
 
   // Generate code for function body
   funcNode.body()->accept(*this);
-  if (!valStack_.empty()) {
-    // Everything went well, generate ret instruction
-    // returning function body expression value
-    builder_.CreateRet(valStack_.front());
+  // The AST may be freed once the function is generated
+  hasher_.reset();
+  intInference_.reset();
+  taskCosts_.reset();
+  subexprValues_.clear();
+  subexprLog_.clear();
+
+  builder_.SetCurrentDebugLocation(DebugLoc());
+  debugScope_ = nullptr;
+  if (subprogram) {
+    debugBuilder_->finalizeSubprogram(subprogram);
+  }
+
+  if (valStack_.empty()) {
+    return false;
+  }
+
+  // Everything went well, generate ret instruction
+  // returning function body expression value
+  Value *retVal = valStack_.front();
+  valStack_.pop_front();
+  builder_.CreateRet(integer ? retVal : toDouble(retVal));
+  verifyFunction(*fun);
+
+  // Optimize the function
+  theFPM_->run(*fun);
+  return true;
+}
+
+bool Codegen::isInteger(const ExprNode &expr) const {
+  return intInference_ && intInference_->isInteger(expr);
+}
+
+Value *Codegen::toDouble(Value *val) {
+  if (!val->getType()->isIntegerTy()) {
+    return val;
+  }
+  return builder_.CreateSIToFP(val, Type::getDoubleTy(llvmContext_),
+                               "inttofp");
+}
+
+// Emits the integer add, sub or mul `id`, and returns kIntegerOverflow from
+// the integer version being generated if its result leaves the exact range
+Value *Codegen::emitIntegerOp(Intrinsic::ID id, Value *lhs, Value *rhs,
+                              const Twine &name) {
+  Value *resultAndOverflow = builder_.CreateBinaryIntrinsic(id, lhs, rhs);
+  Value *result = builder_.CreateExtractValue(resultAndOverflow, 0, name);
+  // |result| > kMaxExactInteger, as an unsigned compare of the shifted value
+  Type *int64Ty = Type::getInt64Ty(llvmContext_);
+  Value *inexact = builder_.CreateICmpUGT(
+      builder_.CreateAdd(result, ConstantInt::get(int64Ty, kMaxExactInteger)),
+      ConstantInt::get(int64Ty, 2 * kMaxExactInteger));
+  branchOnOverflow(builder_.CreateOr(
+      builder_.CreateExtractValue(resultAndOverflow, 1), inexact, "overflow"));
+  return result;
+}
+
+// Returns kIntegerOverflow from the integer version being generated if `val`,
+// the result of an integer version, is kIntegerOverflow
+Value *Codegen::checkIntegerResult(Value *val) {
+  branchOnOverflow(builder_.CreateICmpEQ(
+      val, ConstantInt::get(val->getType(), kIntegerOverflow, true),
+      "overflow"));
+  return val;
+}
+
+void Codegen::branchOnOverflow(Value *overflow) {
+  Function *fun = builder_.GetInsertBlock()->getParent();
+  assert(fun->getReturnType()->isIntegerTy() && "not an integer version");
+  if (!overflowBB_) {
+    overflowBB_ = BasicBlock::Create(llvmContext_, "overflow", fun);
+    IRBuilder<>(overflowBB_)
+        .CreateRet(ConstantInt::get(fun->getReturnType(), kIntegerOverflow,
+                                    true));
+  }
+  BasicBlock *contBB = BasicBlock::Create(llvmContext_, "exact", fun);
+  builder_.CreateCondBr(overflow, overflowBB_, contBB,
+                        overflowWeights(llvmContext_));
+  builder_.SetInsertPoint(contBB);
+}
+
+// Returns the result of the integer version call `result` as a double,
+// calling the double version `doubleFunc` with the same args instead if it
+// overflowed
+Value *Codegen::emitOverflowFallback(Function *doubleFunc,
+                                     const std::vector<Value *> &args,
+                                     Value *result) {
+  Function *fun = builder_.GetInsertBlock()->getParent();
+  BasicBlock *fallbackBB = BasicBlock::Create(llvmContext_, "overflow", fun);
+  BasicBlock *contBB = BasicBlock::Create(llvmContext_, "callcont", fun);
+  Value *overflow = builder_.CreateICmpEQ(
+      result, ConstantInt::get(result->getType(), kIntegerOverflow, true),
+      "overflow");
+  Value *exactResult = toDouble(result);
+  BasicBlock *callBB = builder_.GetInsertBlock();
+  builder_.CreateCondBr(overflow, fallbackBB, contBB,
+                        overflowWeights(llvmContext_));
+
+  builder_.SetInsertPoint(fallbackBB);
+  std::vector<Value *> doubleArgs;
+  for (size_t i = 0; i < args.size(); ++i) {
+    // Buffer args are passed the same way to both versions
+    bool isValue = doubleFunc->getArg(i)->getType()->isDoubleTy();
+    doubleArgs.push_back(isValue ? toDouble(args[i]) : args[i]);
+  }
+  Value *fallbackResult =
+      builder_.CreateCall(doubleFunc, doubleArgs, "calltmp");
+  builder_.CreateBr(contBB);
+
+  builder_.SetInsertPoint(contBB);
+  PHINode *phiNode =
+      builder_.CreatePHI(Type::getDoubleTy(llvmContext_), 2, "callval");
+  phiNode->addIncoming(exactResult, callBB);
+  phiNode->addIncoming(fallbackResult, fallbackBB);
+  return phiNode;
+}
+
+bool Codegen::parallelCallsEnabled() const {
+  // Profile counters are not updated atomically
+  return options_.parallelCalls && options_.profileGenerate.empty();
+}
+
+// Evaluates the args of `callExpr` and spawns the call as a task if the
+// runtime has room for one, or else calls it
+Codegen::Task Codegen::spawnCall(CallExprNode &callExpr) {
+  Function *func = getFunction(callExpr.callee());
+  if (!func || func->arg_size() != callExpr.args().size()) {
+    // Report the error
+    callExpr.accept(*this);
+    return Task();
+  }
+  bool integer = intInference_ && intInference_->callsIntegerVersion(callExpr);
+  Function *doubleFunc = func;
+  if (integer) {
+    func = getFunction(callExpr.callee() + kIntegerSuffix);
+  }
+
+  std::vector<Value *> argsV;
+  for (const auto &arg : callExpr.args()) {
+    arg->accept(*this);
+    if (valStack_.empty()) {
+      return Task();
+    }
+    argsV.emplace_back(integer ? valStack_.front()
+                               : toDouble(valStack_.front()));
     valStack_.pop_front();
-    verifyFunction(*fun);
+  }
+
+  // The frame is a KlcTask header followed by the args and the result. It
+  // lives in the entry block, the task is joined before returning.
+  PointerType *charPtrTy = Type::getInt8PtrTy(llvmContext_);
+  std::vector<Type *> fields{charPtrTy, Type::getInt64Ty(llvmContext_)};
+  for (Value *arg : argsV) {
+    fields.push_back(arg->getType());
+  }
+  fields.push_back(func->getReturnType());
+  StructType *frameTy = StructType::get(llvmContext_, fields);
+  Function *fun = builder_.GetInsertBlock()->getParent();
+  BasicBlock &entryBB = fun->getEntryBlock();
+  Task task;
+  task.frame = IRBuilder<>(&entryBB, entryBB.begin())
+                   .CreateAlloca(frameTy, nullptr, "task");
+  if (integer && !isInteger(callExpr)) {
+    task.doubleFunc = doubleFunc;
+    task.args = argsV;
+  }
+
+  emitLocation(callExpr);
+  FunctionCallee shouldSpawnFn = theModule_->getOrInsertFunction(
+      "klc_should_spawn", Type::getInt32Ty(llvmContext_));
+  task.spawned = builder_.CreateIsNotNull(
+      builder_.CreateCall(shouldSpawnFn, {}), "spawned");
+  BasicBlock *spawnBB = BasicBlock::Create(llvmContext_, "spawn", fun);
+  BasicBlock *callBB = BasicBlock::Create(llvmContext_, "call", fun);
+  BasicBlock *contBB = BasicBlock::Create(llvmContext_, "spawncont", fun);
+  builder_.CreateCondBr(task.spawned, spawnBB, callBB);
+
+  builder_.SetInsertPoint(spawnBB);
+  builder_.CreateStore(
+      builder_.CreateBitCast(getTaskFunction(func, frameTy), charPtrTy),
+      builder_.CreateStructGEP(frameTy, task.frame, 0));
+  for (unsigned i = 0; i < argsV.size(); ++i) {
+    builder_.CreateStore(argsV[i],
+                         builder_.CreateStructGEP(frameTy, task.frame, i + 2));
+  }
+  FunctionCallee spawnFn = theModule_->getOrInsertFunction(
+      "klc_spawn", Type::getVoidTy(llvmContext_), charPtrTy);
+  builder_.CreateCall(spawnFn,
+                      {builder_.CreateBitCast(task.frame, charPtrTy)});
+  builder_.CreateBr(contBB);
+
+  builder_.SetInsertPoint(callBB);
+  builder_.CreateStore(
+      builder_.CreateCall(func, argsV, "calltmp"),
+      builder_.CreateStructGEP(frameTy, task.frame, argsV.size() + 2));
+  builder_.CreateBr(contBB);
+
+  builder_.SetInsertPoint(contBB);
+  return task;
+}
+
+Value *Codegen::joinTask(const Task &task) {
+  Function *fun = builder_.GetInsertBlock()->getParent();
+  BasicBlock *joinBB = BasicBlock::Create(llvmContext_, "join", fun);
+  BasicBlock *joinedBB = BasicBlock::Create(llvmContext_, "joined", fun);
+  builder_.CreateCondBr(task.spawned, joinBB, joinedBB);
+
+  builder_.SetInsertPoint(joinBB);
+  PointerType *charPtrTy = Type::getInt8PtrTy(llvmContext_);
+  FunctionCallee joinFn = theModule_->getOrInsertFunction(
+      "klc_join", Type::getVoidTy(llvmContext_), charPtrTy);
+  builder_.CreateCall(joinFn, {builder_.CreateBitCast(task.frame, charPtrTy)});
+  builder_.CreateBr(joinedBB);
+
+  builder_.SetInsertPoint(joinedBB);
+  auto *frameTy = cast<StructType>(task.frame->getAllocatedType());
+  unsigned result = frameTy->getNumElements() - 1;
+  Value *val = builder_.CreateLoad(
+      frameTy->getElementType(result),
+      builder_.CreateStructGEP(frameTy, task.frame, result), "taskval");
+  if (!val->getType()->isIntegerTy()) {
+    return val;
+  }
+  // An integer version returns kIntegerOverflow too, a double version calls
+  // the double version of the callee instead
+  return task.doubleFunc ? emitOverflowFallback(task.doubleFunc, task.args, val)
+                         : checkIntegerResult(val);
+}
+
+// Returns the function run by the tasks calling `callee`, which reads the
+// args from a frame of type frameTy and stores the result into it
+Function *Codegen::getTaskFunction(Function *callee, StructType *frameTy) {
+  std::string name = (callee->getName() + ".task").str();
+  if (Function *fun = theModule_->getFunction(name)) {
+    return fun;
+  }
+
+  Function *fun = Function::Create(
+      FunctionType::get(Type::getVoidTy(llvmContext_),
+                        {Type::getInt8PtrTy(llvmContext_)}, false),
+      Function::InternalLinkage, name, theModule_.get());
+  IRBuilder<> builder(BasicBlock::Create(llvmContext_, "entry", fun));
+  Value *frame =
+      builder.CreateBitCast(fun->getArg(0), frameTy->getPointerTo());
+  unsigned result = frameTy->getNumElements() - 1;
+  std::vector<Value *> args;
+  for (unsigned i = 2; i < result; ++i) {
+    args.push_back(builder.CreateLoad(frameTy->getElementType(i),
+                                      builder.CreateStructGEP(frameTy, frame,
+                                                              i)));
+  }
+  builder.CreateStore(builder.CreateCall(callee, args),
+                      builder.CreateStructGEP(frameTy, frame, result));
+  builder.CreateRetVoid();
+  verifyFunction(*fun);
+  return fun;
+}
+
+Function *Codegen::getFunction(const std::string &name) {
+  if (auto *alias = theModule_->getNamedAlias(name)) {
+    return dyn_cast<Function>(alias->getAliaseeObject());
+  }
+  if (Function *fun = theModule_->getFunction(name)) {
+    return fun;
+  }
+
+  // Declared in a module that was handed over to the JIT
+  auto it = protos_.find(name);
+  if (it != protos_.end()) {
+    Function *fun = Function::Create(it->second, Function::ExternalLinkage,
+                                     name, theModule_.get());
+    addBufferAttrs(fun);
+    return fun;
+  }
+  return nullptr;
+}
+
+FunctionType *Codegen::getFunctionType(const std::vector<bool> &bufferParams,
+                                       Type *valueTy) {
+  std::vector<Type *> params;
+  for (bool isBuffer : bufferParams) {
+    if (isBuffer) {
+      params.push_back(Type::getDoublePtrTy(llvmContext_));
+      params.push_back(Type::getInt64Ty(llvmContext_));
+    } else {
+      params.push_back(valueTy);
+    }
+  }
+  // last arg false means it's not a vararg function
+  return FunctionType::get(valueTy, params, false);
+}
+
+Function *Codegen::createFunction(const std::string &name,
+                                  FunctionNode &funcNode, Type *valueTy) {
+  Function *fun =
+      Function::Create(getFunctionType(funcNode.bufferParams(), valueTy),
+                       Function::ExternalLinkage, name, theModule_.get());
+  addBufferAttrs(fun);
+  nameArgs(fun, funcNode);
+  return fun;
+}
+
+void Codegen::addBufferAttrs(Function *fun) {
+  // Buffers passed to a call do not overlap and are aligned for doubles,
+  // which lets the loops over them be vectorized
+  for (Argument &arg : fun->args()) {
+    if (arg.getType()->isPointerTy()) {
+      arg.addAttr(Attribute::NoAlias);
+      arg.addAttr(Attribute::NoCapture);
+      arg.addAttr(Attribute::getWithAlignment(llvmContext_, Align(8)));
+    }
+  }
+}
+
+void Codegen::nameArgs(Function *fun, FunctionNode &funcNode) {
+  auto arg = fun->arg_begin();
+  for (size_t i = 0; i < funcNode.args().size(); ++i) {
+    (arg++)->setName(funcNode.args()[i]);
+    if (funcNode.isBufferParam(i)) {
+      (arg++)->setName(funcNode.args()[i] + ".len");
+    }
+  }
+}
+
+Value *Codegen::getBuffer(ExprNode &expr, Value *&len) {
+  auto *varExpr = dynamic_cast<VariableExprNode *>(&expr);
+  if (!varExpr) {
+    return nullptr;
+  }
+  auto it = symTable_.find(varExpr->varName());
+  if (it == symTable_.end() || !it->second->getType()->isPointerTy()) {
+    return nullptr;
+  }
+  len = symTable_[varExpr->varName() + ".len"];
+  return it->second;
+}
+
+void Codegen::flushModule() {
+  for (Function &fun : *theModule_) {
+    if (!fun.isDeclaration()) {
+      finishModule();
+      addModuleToJit();
+      return;
+    }
+  }
+}
+
+void Codegen::addModuleToJit() {
+  lastFn_ = nullptr;
+  jit_->addModule(
+      orc::ThreadSafeModule(std::move(theModule_), threadSafeContext_));
+  newModule();
+}
+
+DIFile *Codegen::getDebugFile(const std::string &sourceName) {
+  DIFile *file = debugBuilder_->createFile(sourceName, ".");
+  if (!debugUnit_) {
+    debugUnit_ = debugBuilder_->createCompileUnit(
+        dwarf::DW_LANG_C, file, "klc", /*isOptimized=*/true, "", 0);
+  }
+  return file;
+}
+
+DISubprogram *Codegen::beginDebugFunction(Function *fun,
+                                          FunctionNode &funcNode) {
+  if (!debugBuilder_) {
+    return nullptr;
+  }
+
+  DIFile *file = getDebugFile(funcNode.sourceName());
+  DIType *valueTy =
+      fun->getReturnType()->isIntegerTy()
+          ? debugBuilder_->createBasicType("long", 64, dwarf::DW_ATE_signed)
+          : debugBuilder_->createBasicType("double", 64, dwarf::DW_ATE_float);
+  // Return type followed by the arg types
+  SmallVector<Metadata *, 8> types(1 + fun->arg_size(), valueTy);
+  DISubroutineType *funTy = debugBuilder_->createSubroutineType(
+      debugBuilder_->getOrCreateTypeArray(types));
+
+  unsigned line = funcNode.loc().line;
+  DISubprogram *subprogram = debugBuilder_->createFunction(
+      file, fun->getName(), StringRef(), file, line, funTy, line,
+      DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
+  fun->setSubprogram(subprogram);
 
-    // Optimize the function
-    theFPM_->run(*fun);
+  debugScope_ = subprogram;
+  emitLocation(funcNode);
+  return subprogram;
+}
+
+void Codegen::emitLocation(BaseNode &node) {
+  if (!debugScope_) {
     return;
   }
+  builder_.SetCurrentDebugLocation(
+      DILocation::get(llvmContext_, node.loc().line, node.loc().col,
+                      debugScope_));
+}
 
-  // Error in generating body, remove function
-  fun->eraseFromParent();
+bool Codegen::dedupEnabled() const {
+  // Profile counters are per function and per if expression, sharing
+  // bodies or branches would mix them up.
+  return options_.dedup && options_.profileGenerate.empty() &&
+         options_.profileUse.empty();
+}
+
+bool Codegen::reuseSubexpr(ExprNode &expr) {
+  if (!dedupEnabled() || !hasher_) {
+    return false;
+  }
+  const StructuralHasher::Info &info = hasher_->info(expr);
+  if (!info.pure) {
+    return false;
+  }
+  auto range = subexprValues_.equal_range(info.hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (structurallyEqual(*it->second.first, expr)) {
+      valStack_.emplace_front(it->second.second);
+      return true;
+    }
+  }
+  return false;
+}
+
+void Codegen::recordSubexpr(ExprNode &expr, Value *val) {
+  if (!dedupEnabled() || !hasher_ || !val) {
+    return;
+  }
+  const StructuralHasher::Info &info = hasher_->info(expr);
+  if (info.pure) {
+    subexprValues_.emplace(info.hash, std::make_pair(&expr, val));
+    subexprLog_.push_back(&expr);
+  }
+}
+
+void Codegen::popSubexprScope(size_t scope) {
+  while (subexprLog_.size() > scope) {
+    ExprNode *expr = subexprLog_.back();
+    subexprLog_.pop_back();
+    auto range = subexprValues_.equal_range(hasher_->info(*expr).hash);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second.first == expr) {
+        subexprValues_.erase(it);
+        break;
+      }
+    }
+  }
+}
+
+void Codegen::loadProfile(const std::string &fileName) {
+  std::ifstream in(fileName);
+  if (!in) {
+    logError("cannot open profile '" + fileName + "'");
+    return;
+  }
+
+  // Each line holds: function-name counter-count counters...
+  std::string name;
+  size_t numCounts;
+  bool truncated = false;
+  while (in >> name >> numCounts) {
+    // Grown as the counters are read, a malformed count runs out of them
+    // rather than allocating it up front. A count not matching the function
+    // is reported once its body is known.
+    ProfileCounts counts;
+    uint64_t count;
+    while (counts.size() < numCounts && in >> count) {
+      counts.push_back(count);
+    }
+    if (counts.size() < numCounts) {
+      truncated = true;
+      break;
+    }
+    profile_[name] = std::move(counts);
+  }
+
+  if (truncated || !in.eof()) {
+    logError("malformed profile '" + fileName + "'");
+    profile_.clear();
+    return;
+  }
+
+  // A profile summary lets the profile guided passes (inliner, hot/cold
+  // splitting, block placement) tell hot code from cold code.
+  InstrProfSummaryBuilder summaryBuilder(ProfileSummaryBuilder::DefaultCutoffs);
+  for (const auto &entry : profile_) {
+    summaryBuilder.addRecord(InstrProfRecord(entry.second));
+  }
+  profileSummary_ = summaryBuilder.getSummary()->getMD(llvmContext_);
+}
+
+void Codegen::beginFunctionProfile(Function *fun, FunctionNode &funcNode) {
+  profCounters_ = nullptr;
+  profCounts_ = nullptr;
+  nextProfSlot_ = 1;
+
+  // Anonymous functions have no stable name to key their profile with
+  if (funcNode.name().empty()) {
+    return;
+  }
+
+  BranchCounter branchCounter;
+  funcNode.accept(branchCounter);
+  unsigned numSlots = 1 + 2 * branchCounter.count();
+
+  if (!options_.profileGenerate.empty()) {
+    // The integer and double versions of a function share its counters,
+    // which -fprofile-use reads for both
+    std::string countersName = "__klc_prof_" + funcNode.name();
+    profCounters_ = theModule_->getNamedGlobal(countersName);
+    if (!profCounters_) {
+      ArrayType *countersTy =
+          ArrayType::get(Type::getInt64Ty(llvmContext_), numSlots);
+      profCounters_ = new GlobalVariable(
+          *theModule_, countersTy, false, GlobalValue::ExternalLinkage,
+          ConstantAggregateZero::get(countersTy), countersName);
+      profiledFns_.emplace_back(funcNode.name(), numSlots);
+    }
+    emitProfileIncrement(0);
+  }
+
+  auto it = profile_.find(funcNode.name());
+  if (it != profile_.end()) {
+    if (it->second.size() != numSlots) {
+      logError("profile of function '" + funcNode.name() +
+               "' does not match its body, ignoring it");
+      return;
+    }
+    profCounts_ = &it->second;
+    uint64_t entryCount = (*profCounts_)[0];
+    fun->setEntryCount(entryCount);
+    if (entryCount == 0) {
+      fun->addFnAttr(Attribute::Cold);
+    }
+  }
+}
+
+void Codegen::emitProfileIncrement(unsigned slot) {
+  if (!profCounters_) {
+    return;
+  }
+  Type *int64Ty = Type::getInt64Ty(llvmContext_);
+  Value *counter = builder_.CreateConstInBoundsGEP2_32(
+      profCounters_->getValueType(), profCounters_, 0, slot);
+  Value *count = builder_.CreateLoad(int64Ty, counter, "prof.count");
+  builder_.CreateStore(builder_.CreateAdd(count, ConstantInt::get(int64Ty, 1)),
+                       counter);
+}
+
+void Codegen::setBranchWeights(BranchInst *br, unsigned thenSlot) {
+  if (!profCounts_) {
+    return;
+  }
+  uint64_t thenCount = (*profCounts_)[thenSlot];
+  uint64_t elseCount = (*profCounts_)[thenSlot + 1];
+
+  // Branch weights are 32 bit, scale the counts down if needed
+  uint64_t scale =
+      std::max(thenCount, elseCount) / std::numeric_limits<uint32_t>::max() +
+      1;
+  br->setMetadata(LLVMContext::MD_prof,
+                  MDBuilder(llvmContext_)
+                      .createBranchWeights(thenCount / scale,
+                                           elseCount / scale));
+}
+
+void Codegen::emitProfileDumper() {
+  Type *int32Ty = Type::getInt32Ty(llvmContext_);
+  Type *int64Ty = Type::getInt64Ty(llvmContext_);
+  PointerType *charPtrTy = Type::getInt8PtrTy(llvmContext_);
+
+  FunctionCallee fopenFn = theModule_->getOrInsertFunction(
+      "fopen", FunctionType::get(charPtrTy, {charPtrTy, charPtrTy}, false));
+  FunctionCallee fprintfFn = theModule_->getOrInsertFunction(
+      "fprintf", FunctionType::get(int32Ty, {charPtrTy, charPtrTy}, true));
+  FunctionCallee fcloseFn = theModule_->getOrInsertFunction(
+      "fclose", FunctionType::get(int32Ty, {charPtrTy}, false));
+
+  Function *dumpFn = Function::Create(
+      FunctionType::get(Type::getVoidTy(llvmContext_), false),
+      Function::InternalLinkage, "__klc_prof_dump", theModule_.get());
+  BasicBlock *entryBB = BasicBlock::Create(llvmContext_, "entry", dumpFn);
+  BasicBlock *dumpBB = BasicBlock::Create(llvmContext_, "dump", dumpFn);
+  BasicBlock *retBB = BasicBlock::Create(llvmContext_, "ret", dumpFn);
+
+  builder_.SetInsertPoint(entryBB);
+  Value *file = builder_.CreateCall(
+      fopenFn, {builder_.CreateGlobalStringPtr(options_.profileGenerate),
+                builder_.CreateGlobalStringPtr("w")});
+  builder_.CreateCondBr(builder_.CreateIsNull(file), retBB, dumpBB);
+
+  // Write one line per function: name counter-count counters...
+  builder_.SetInsertPoint(dumpBB);
+  Value *countFmt = builder_.CreateGlobalStringPtr(" %llu");
+  for (const auto &fn : profiledFns_) {
+    // Counters of functions in modules handed over to the JIT are declared
+    unsigned numSlots = fn.second;
+    ArrayType *countersTy = ArrayType::get(int64Ty, numSlots);
+    Constant *counters =
+        theModule_->getOrInsertGlobal("__klc_prof_" + fn.first, countersTy);
+    builder_.CreateCall(
+        fprintfFn, {file,
+                    builder_.CreateGlobalStringPtr(
+                        fn.first + " " + std::to_string(numSlots))});
+    for (unsigned slot = 0; slot < numSlots; ++slot) {
+      Value *counter =
+          builder_.CreateConstInBoundsGEP2_32(countersTy, counters, 0, slot);
+      builder_.CreateCall(fprintfFn,
+                          {file, countFmt,
+                           builder_.CreateLoad(int64Ty, counter)});
+    }
+    builder_.CreateCall(fprintfFn,
+                        {file, builder_.CreateGlobalStringPtr("\n")});
+  }
+  builder_.CreateCall(fcloseFn, {file});
+  builder_.CreateBr(retBB);
+
+  builder_.SetInsertPoint(retBB);
+  builder_.CreateRetVoid();
+  verifyFunction(*dumpFn);
+
+  // Run the dump routine when the program exits
+  appendToGlobalDtors(*theModule_, dumpFn, 0);
+}
+
+void Codegen::finishModule() {
+  if (options_.specializeBudget) {
+    specializeConstantCalls(*theModule_, *theFPM_, options_.specializeBudget);
+  }
+  if (debugBuilder_) {
+    debugBuilder_->finalize();
+  }
+}
+
+void Codegen::finalizeModule() {
+  if (!options_.profileGenerate.empty()) {
+    emitProfileDumper();
+  }
+  finishModule();
+  linkPrelude();
+}
+
+std::string Codegen::targetName() const {
+  return targetMachine_->getTargetTriple().str() + "/" +
+         targetMachine_->getTargetCPU().str();
+}
+
+bool Codegen::writeSnapshot(const std::string &fileName) {
+  if (jit_) {
+    logError("snapshots cannot be written in JIT mode");
+    return false;
+  }
+
+  Snapshot snapshot;
+  snapshot.target = targetName();
+  for (const auto &proto : protos_) {
+    const std::string &name = proto.first;
+    if (StringRef(name).endswith(kIntegerSuffix)) {
+      continue;
+    }
+    SnapshotFunction fn;
+    fn.name = name;
+    // A buffer is passed as a pointer and a length
+    FunctionType *ft = proto.second;
+    for (unsigned i = 0; i < ft->getNumParams(); ++i) {
+      bool isBuffer = ft->getParamType(i)->isPointerTy();
+      fn.bufferParams.push_back(isBuffer);
+      i += isBuffer;
+    }
+    if (definedFns_.count(name)) {
+      fn.flags |= SnapshotFunction::defined;
+    }
+    if (integerFns_.count(name)) {
+      fn.flags |= SnapshotFunction::integerVersion;
+    }
+    auto it = taskInfos_.find(name);
+    if (it != taskInfos_.end()) {
+      if (it->second.pure) {
+        fn.flags |= SnapshotFunction::pure;
+      }
+      fn.taskCost = it->second.cost;
+    }
+    snapshot.functions.push_back(std::move(fn));
+  }
+  std::sort(snapshot.functions.begin(), snapshot.functions.end(),
+            [](const SnapshotFunction &a, const SnapshotFunction &b) {
+              return a.name < b.name;
+            });
+  snapshot.binaryOps.assign(binaryOps_.begin(), binaryOps_.end());
+
+  SmallVector<char, 0> bitcode;
+  raw_svector_ostream bitcodeOut(bitcode);
+  WriteBitcodeToFile(*theModule_, bitcodeOut);
+  snapshot.bitcode = bitcode.data();
+  snapshot.bitcodeSize = bitcode.size();
+
+  // Code generation rewrites the IR, so it comes after the bitcode
+  SmallVector<char, 0> object;
+  raw_svector_ostream objectOut(object);
+  legacy::PassManager codegenPasses;
+  if (targetMachine_->addPassesToEmitFile(codegenPasses, objectOut, nullptr,
+                                          CGFT_ObjectFile)) {
+    logError("cannot emit object files for " + targetName());
+    return false;
+  }
+  codegenPasses.run(*theModule_);
+  snapshot.object = object.data();
+  snapshot.objectSize = object.size();
+
+  std::error_code err;
+  raw_fd_ostream out(fileName, err);
+  if (err) {
+    logError("cannot write '" + fileName + "': " + err.message());
+    return false;
+  }
+  out << serializeSnapshot(snapshot);
+  return true;
+}
+
+bool Codegen::loadSnapshot(const std::string &fileName) {
+  // Mapped rather than read, only the pages used are loaded
+  auto buffer = MemoryBuffer::getFile(fileName, /*IsText=*/false,
+                                      /*RequiresNullTerminator=*/false);
+  if (!buffer) {
+    logError("cannot open snapshot '" + fileName + "'");
+    return false;
+  }
+  Snapshot snapshot;
+  if (!deserializeSnapshot((*buffer)->getBufferStart(),
+                           (*buffer)->getBufferSize(), snapshot)) {
+    logError("malformed snapshot '" + fileName + "'");
+    return false;
+  }
+  if (snapshot.target != targetName()) {
+    logError("snapshot '" + fileName + "' was compiled for " +
+             snapshot.target);
+    return false;
+  }
+
+  Type *doubleTy = Type::getDoubleTy(llvmContext_);
+  Type *int64Ty = Type::getInt64Ty(llvmContext_);
+  for (const auto &fn : snapshot.functions) {
+    protos_[fn.name] = getFunctionType(fn.bufferParams, doubleTy);
+    if (fn.flags & SnapshotFunction::integerVersion) {
+      protos_[fn.name + kIntegerSuffix] =
+          getFunctionType(fn.bufferParams, int64Ty);
+      integerFns_.insert(fn.name);
+    }
+    if (fn.flags & SnapshotFunction::defined) {
+      definedFns_.insert(fn.name);
+    }
+    taskInfos_[fn.name] =
+        TaskInfo{(fn.flags & SnapshotFunction::pure) != 0, fn.taskCost};
+  }
+  binaryOps_.insert(snapshot.binaryOps.begin(), snapshot.binaryOps.end());
+
+  if (jit_ && !jit_->addObject(MemoryBuffer::getMemBuffer(
+                  StringRef(snapshot.object, snapshot.objectSize), fileName,
+                  /*RequiresNullTerminator=*/false))) {
+    return false;
+  }
+  preludeBitcode_ = StringRef(snapshot.bitcode, snapshot.bitcodeSize);
+  snapshot_ = std::move(*buffer);
+  return true;
+}
+
+void Codegen::linkPrelude() {
+  if (jit_ || preludeBitcode_.empty()) {
+    return;
+  }
+  // Functions are only read from the bitcode when the module uses them
+  auto prelude = getLazyBitcodeModule(
+      MemoryBufferRef(preludeBitcode_, "prelude"), llvmContext_);
+  if (!prelude) {
+    logError(toString(prelude.takeError()));
+    return;
+  }
+  if (Linker::linkModules(*theModule_, std::move(*prelude),
+                          Linker::Flags::LinkOnlyNeeded)) {
+    logError("cannot link the prelude");
+  }
+  preludeBitcode_ = StringRef();
+}
+
+void Codegen::evaluateTopLevelExpr() {
+  if (!jit_ || lastExprName_.empty()) {
+    return;
+  }
+  std::string name = std::move(lastExprName_);
+  lastExprName_.clear();
+
+  // The expression is alone in its module (see visit(FunctionNode &)), so
+  // its code can be freed as soon as it ran
+  finishModule();
   lastFn_ = nullptr;
+  orc::ResourceTrackerSP tracker = jit_->addTemporaryModule(
+      orc::ThreadSafeModule(std::move(theModule_), threadSafeContext_));
+  newModule();
+  if (!tracker) {
+    return;
+  }
+  if (uint64_t addr = jit_->lookup(name)) {
+    auto *expr = reinterpret_cast<double (*)()>(addr);
+    std::cerr << "Evaluated to " << expr() << std::endl;
+  }
+  jit_->removeModule(std::move(tracker));
+
+  jit_->evictColdModules();
+  if (options_.memoryReport) {
+    printMemoryReport();
+  }
+}
+
+void Codegen::printMemoryReport() const {
+  std::cerr << "Memory: AST " << BaseNode::liveBytes() << " bytes, IR "
+            << jit_->irBytes() << " bytes, code " << jit_->codeBytes()
+            << " bytes" << std::endl;
+}
+
+void Codegen::shutdown() {
+  if (!jit_) {
+    return;
+  }
+  addModuleToJit();
+  jit_->runInitializers();
+  jit_->runDeinitializers();
+  if (options_.memoryReport) {
+    printMemoryReport();
+  }
 }
 
 void Codegen::printIR(const char *msg) const {
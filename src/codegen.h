@@ -1,25 +1,89 @@
 #pragma once
 
 #include "ast.h"
+#include "intinfer.h"
+#include "jit.h"
+#include "serialize.h"
+#include "structhash.h"
+#include "taskcost.h"
 #include "visitor.h"
 #include "llvm/IR/LLVMContext.h"
+#include <cstdint>
 #include <deque>
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/IR/DIBuilder.h>
+#include <llvm/IR/GlobalVariable.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Module.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Target/TargetMachine.h>
+#include <map>
 #include <memory>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+struct CodegenOptions {
+  // When set, instrument function entries and if/then/else branches with
+  // counters and write them to this file when the program exits.
+  std::string profileGenerate;
+  // When set, read counters from this file (written by an instrumented
+  // build) and attach entry counts and branch weights to the IR.
+  std::string profileUse;
+  // Maximum number of instructions call-site specialization on constant
+  // arguments may add to the module, 0 disables it.
+  unsigned specializeBudget = 0;
+  // Vector math library the vectorizers may call for vectorized math
+  // intrinsics (sin, cos, exp, ...).
+  llvm::TargetLibraryInfoImpl::VectorLibrary vecLib =
+      llvm::TargetLibraryInfoImpl::NoLibrary;
+  // Compile functions whose bodies are identical up to parameter renaming
+  // once and alias the duplicates, and reuse the value of repeated pure
+  // subexpressions within a function.
+  bool dedup = false;
+  // Also compile each function whose result is an integer when its args
+  // are into an i64 version, and call it where the args are integers. The
+  // double version is called instead when the result, or one computed on
+  // the way, leaves +/-2^53.
+  bool integerInference = false;
+  // Run the calls to expensive pure functions as tasks on a work-stealing
+  // thread pool while the independent expressions next to them are
+  // evaluated
+  bool parallelCalls = false;
+  // Emit DWARF debug info with the source locations of the AST
+  bool debugInfo = false;
+  // Compile with the JIT and evaluate top-level expressions as they are read
+  bool jit = false;
+  JitOptions jitOptions;
+  // In JIT mode, print the memory taken by the AST, the IR and the code
+  // after each top-level expression
+  bool memoryReport = false;
+};
 
 class Codegen : public Visitor {
 public:
-  Codegen() : builder_(llvmContext_) {
-    theModule_ =
-        std::make_unique<llvm::Module>("my first module", llvmContext_);
-    setupFunctionPassManager();
+  Codegen(CodegenOptions options = CodegenOptions())
+      : options_(std::move(options)),
+        threadSafeContext_(std::make_unique<llvm::LLVMContext>()),
+        llvmContext_(*threadSafeContext_.getContext()),
+        builder_(llvmContext_) {
+    setupTargetMachine();
+    if (options_.jit) {
+      jit_ = KaleidoscopeJIT::create(options_.jitOptions);
+    }
+    if (!options_.profileUse.empty()) {
+      loadProfile(options_.profileUse);
+    }
+    newModule();
   }
   ~Codegen() = default;
 
+  void setupTargetMachine();
   void setupFunctionPassManager();
+  void newModule();
 
   void visit(ExprNode &exprNode) override;
   void visit(NumberExprNode &numExpr) override;
@@ -27,18 +91,165 @@ public:
   void visit(BinaryExprNode &binExpr) override;
   void visit(CallExprNode &callExpr) override;
   void visit(IfElseExprNode &ifelseExpr) override;
+  void visit(IndexExprNode &indexExpr) override;
   void visit(FunctionNode &funcNode) override;
 
+  // Emit module level code which can only be generated once all the
+  // functions are known (e.g. the profile dump routine).
+  void finalizeModule();
+
+  // Write the functions generated so far to a prelude snapshot: their
+  // prototypes, the binary operators they define, their bitcode and their
+  // native code. Consumes the module, and cannot be used in JIT mode.
+  bool writeSnapshot(const std::string &fileName);
+  // Make the functions of a prelude snapshot callable without generating
+  // them again. In JIT mode its native code is loaded, otherwise the
+  // functions the module uses are linked in by finalizeModule().
+  bool loadSnapshot(const std::string &fileName);
+  // The binary operators defined so far and their precedences
+  const std::map<char, int> &binaryOps() const { return binaryOps_; }
+
+  // In JIT mode, compile the module holding the last top-level expression
+  // and print the expression's value.
+  void evaluateTopLevelExpr();
+  // In JIT mode, compile what is left of the module and run the global
+  // destructors, as a compiled program would at exit.
+  void shutdown();
+
   void printIR(const char *msg) const;
   void printModule() const;
 
 private:
-  llvm::LLVMContext llvmContext_;
+  llvm::Function *getFunction(const std::string &name);
+  llvm::FunctionType *getFunctionType(const std::vector<bool> &bufferParams,
+                                      llvm::Type *valueTy);
+  llvm::Function *createFunction(const std::string &name,
+                                 FunctionNode &funcNode, llvm::Type *valueTy);
+  void addBufferAttrs(llvm::Function *fun);
+  void nameArgs(llvm::Function *fun, FunctionNode &funcNode);
+  llvm::Value *getBuffer(ExprNode &expr, llvm::Value *&len);
+  bool emitFunctionBody(llvm::Function *fun, FunctionNode &funcNode);
+  void emitIntegerVersion(FunctionNode &funcNode);
+  bool isInteger(const ExprNode &expr) const;
+  llvm::Value *toDouble(llvm::Value *val);
+  llvm::Value *emitIntegerOp(llvm::Intrinsic::ID id, llvm::Value *lhs,
+                             llvm::Value *rhs, const llvm::Twine &name);
+  llvm::Value *checkIntegerResult(llvm::Value *val);
+  void branchOnOverflow(llvm::Value *overflow);
+  llvm::Value *emitOverflowFallback(llvm::Function *doubleFunc,
+                                    const std::vector<llvm::Value *> &args,
+                                    llvm::Value *result);
+
+  // A call spawned as a task, unless the runtime made it directly. The
+  // frame holds its args and its result either way.
+  struct Task {
+    llvm::AllocaInst *frame = nullptr;
+    llvm::Value *spawned = nullptr;
+    // Set when a double version spawns an integer version: the double
+    // version of the callee, called with `args` if the task overflows
+    llvm::Function *doubleFunc = nullptr;
+    std::vector<llvm::Value *> args;
+  };
+
+  bool parallelCallsEnabled() const;
+  Task spawnCall(CallExprNode &callExpr);
+  llvm::Value *joinTask(const Task &task);
+  llvm::Function *getTaskFunction(llvm::Function *callee,
+                                  llvm::StructType *frameTy);
+  bool emitBinaryExpr(BinaryExprNode &binExpr, const Task &lhsTask);
+  void finishModule();
+  void linkPrelude();
+  std::string targetName() const;
+  void flushModule();
+  void addModuleToJit();
+  void printMemoryReport() const;
+
+  llvm::DIFile *getDebugFile(const std::string &sourceName);
+  llvm::DISubprogram *beginDebugFunction(llvm::Function *fun,
+                                         FunctionNode &funcNode);
+  void emitLocation(BaseNode &node);
+
+  bool dedupEnabled() const;
+  bool reuseSubexpr(ExprNode &expr);
+  void recordSubexpr(ExprNode &expr, llvm::Value *val);
+  void popSubexprScope(size_t scope);
+
+  // Profile counters of a function: slot 0 counts function entries, and
+  // each if/then/else expression gets two consecutive slots counting the
+  // then and else branches, in the order codegen visits them.
+  using ProfileCounts = std::vector<uint64_t>;
+
+  void loadProfile(const std::string &fileName);
+  void beginFunctionProfile(llvm::Function *fun, FunctionNode &funcNode);
+  void emitProfileIncrement(unsigned slot);
+  void setBranchWeights(llvm::BranchInst *br, unsigned thenSlot);
+  void emitProfileDumper();
+
+  CodegenOptions options_;
+  std::unique_ptr<llvm::TargetMachine> targetMachine_;
+  // Mapped prelude snapshot, declared before jit_ which uses its object
+  std::unique_ptr<llvm::MemoryBuffer> snapshot_;
+  llvm::StringRef preludeBitcode_;
+  std::unique_ptr<KaleidoscopeJIT> jit_;
+
+  llvm::orc::ThreadSafeContext threadSafeContext_;
+  llvm::LLVMContext &llvmContext_;
   llvm::IRBuilder<> builder_;
   std::unique_ptr<llvm::Module> theModule_;
+  // Types of all functions declared so far, so that they can be declared
+  // again in the modules created after handing one over to the JIT
+  std::unordered_map<std::string, llvm::FunctionType *> protos_;
+  std::unordered_set<std::string> definedFns_;
+  std::map<char, int> binaryOps_;
+  // Name of the last top-level expression function, and how many were
+  // generated (JIT mode)
+  std::string lastExprName_;
+  unsigned numExprs_ = 0;
+
+  std::unique_ptr<llvm::DIBuilder> debugBuilder_;
+  llvm::DICompileUnit *debugUnit_ = nullptr;
+  llvm::DISubprogram *debugScope_ = nullptr;
   std::unordered_map<std::string, llvm::Value *> symTable_;
   std::deque<llvm::Value *> valStack_;
   llvm::Function *lastFn_;
 
   std::unique_ptr<llvm::legacy::FunctionPassManager> theFPM_;
+
+  // Names of the functions generated so far, keyed by canonicalForm() of
+  // their node
+  std::unordered_map<std::string, std::string> bodies_;
+  // Structural hashes of the function body being generated
+  std::unique_ptr<StructuralHasher> hasher_;
+  // Values of the pure subexpressions available at the insertion point,
+  // keyed by structural hash
+  std::unordered_multimap<uint64_t, std::pair<ExprNode *, llvm::Value *>>
+      subexprValues_;
+  // Subexpressions in the order they were added to subexprValues_, so the
+  // ones generated in a branch can be dropped when leaving it
+  std::vector<ExprNode *> subexprLog_;
+
+  // Functions which have an integer version
+  std::unordered_set<std::string> integerFns_;
+  // Integer expressions of the function version being generated
+  std::unique_ptr<IntegerInference> intInference_;
+  // Block returning kIntegerOverflow from the integer version being
+  // generated, created on first use
+  llvm::BasicBlock *overflowBB_ = nullptr;
+
+  // Purity and cost of the functions declared so far
+  TaskInfos taskInfos_;
+  // Costs of the expressions of the function being generated
+  std::unique_ptr<TaskCostModel> taskCosts_;
+
+  // Profile counters read from options_.profileUse, keyed by function name
+  std::unordered_map<std::string, ProfileCounts> profile_;
+  llvm::Metadata *profileSummary_ = nullptr;
+  // Instrumented functions and their number of counters
+  std::vector<std::pair<std::string, unsigned>> profiledFns_;
+  // Counter array of the function being generated (instrumented build)
+  llvm::GlobalVariable *profCounters_ = nullptr;
+  // Profile counts of the function being generated (profile use)
+  const ProfileCounts *profCounts_ = nullptr;
+  // Next free counter slot in the function being generated
+  unsigned nextProfSlot_ = 0;
 };
@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#include "frontend.h"
+#include "lexer.h"
+#include "parser.h"
+#include "serialize.h"
+
+namespace {
+
+std::string cachePath(const std::string &cacheDir, uint64_t sourceHash) {
+  std::string path;
+  llvm::raw_string_ostream(path)
+      << cacheDir << "/" << llvm::format_hex_no_prefix(sourceHash, 16)
+      << ".kast";
+  return path;
+}
+
+bool loadCachedAst(const std::string &path, uint64_t sourceHash,
+                   std::vector<FunctionNode::UPtr> &items) {
+  // Large files are mapped rather than read
+  auto buffer = llvm::MemoryBuffer::getFile(path, /*IsText=*/false,
+                                            /*RequiresNullTerminator=*/false);
+  if (!buffer) {
+    return false;
+  }
+  return deserializeAst((*buffer)->getBufferStart(),
+                        (*buffer)->getBufferSize(), sourceHash, items);
+}
+
+void storeCachedAst(const std::string &path, uint64_t sourceHash,
+                    const std::vector<FunctionNode::UPtr> &items) {
+  // Write a unique temporary and rename it, so concurrent klc runs never
+  // see a partially written cache file.
+  int fd;
+  llvm::SmallString<128> tmpPath;
+  if (llvm::sys::fs::createUniqueFile(path + ".%%%%%%.tmp", fd, tmpPath)) {
+    return;
+  }
+  {
+    llvm::raw_fd_ostream out(fd, /*shouldClose=*/true);
+    out << serializeAst(items, sourceHash);
+  }
+  if (llvm::sys::fs::rename(tmpPath, path)) {
+    llvm::sys::fs::remove(tmpPath);
+  }
+}
+
+// The user defined operators a parser starts with, as op and precedence
+// characters
+std::string userOpsKey(const PrecedenceTable &precedence) {
+  std::string key;
+  for (int op = 0; op < kNumOpTokens; ++op) {
+    if (precedence.prec[op] != kBuiltinPrecedence.prec[op]) {
+      key += char(op);
+      key += char(precedence.prec[op]);
+    }
+  }
+  return key;
+}
+
+SourceUnit parseFile(const std::string &fileName, const std::string &cacheDir,
+                     const PrecedenceTable &precedence) {
+  SourceUnit unit;
+  unit.fileName = fileName;
+
+  std::ifstream in(fileName);
+  if (!in) {
+    std::cerr << "error: cannot open '" << fileName << "'" << std::endl;
+    return unit;
+  }
+  std::ostringstream source;
+  source << in.rdbuf();
+
+  // Unchanged sources skip the lexer and parser entirely
+  // Operators from a prelude change how the source parses
+  uint64_t sourceHash = hashSource(userOpsKey(precedence) + source.str());
+  std::string cacheFile;
+  if (!cacheDir.empty()) {
+    cacheFile = cachePath(cacheDir, sourceHash);
+    if (loadCachedAst(cacheFile, sourceHash, unit.items)) {
+      for (auto &item : unit.items) {
+        item->setSourceName(fileName);
+      }
+      unit.ok = true;
+      return unit;
+    }
+  }
+
+  std::istringstream sourceIn(source.str());
+  Lexer lexer{sourceIn};
+  Parser parser{lexer, fileName, precedence};
+  unit.items = parser.parseAll();
+  unit.ok = !parser.hadError();
+
+  if (unit.ok && !cacheFile.empty()) {
+    storeCachedAst(cacheFile, sourceHash, unit.items);
+  }
+  return unit;
+}
+
+// Where a function was declared and defined
+struct FunctionInfo {
+  FunctionNode *decl = nullptr;
+  const std::string *declFile = nullptr;
+  FunctionNode::UPtr def;
+  const std::string *defFile = nullptr;
+};
+
+void logConflict(const std::string &fileName, const std::string &msg,
+                 const std::string &prevFile) {
+  std::cerr << fileName << ": error: " << msg << " (previously in '"
+            << prevFile << "')" << std::endl;
+}
+
+} // namespace
+
+std::vector<SourceUnit> parseFiles(const std::vector<std::string> &fileNames,
+                                   unsigned numThreads,
+                                   const std::string &cacheDir,
+                                   const PrecedenceTable &precedence) {
+  std::vector<SourceUnit> units(fileNames.size());
+  std::atomic<size_t> nextFile{0};
+
+  auto worker = [&]() {
+    for (size_t i = nextFile++; i < fileNames.size(); i = nextFile++) {
+      units[i] = parseFile(fileNames[i], cacheDir, precedence);
+    }
+  };
+
+  size_t numWorkers =
+      std::min<size_t>(std::max(numThreads, 1u), fileNames.size());
+  std::vector<std::thread> pool;
+  for (size_t i = 0; i < numWorkers; ++i) {
+    pool.emplace_back(worker);
+  }
+  for (auto &thread : pool) {
+    thread.join();
+  }
+  return units;
+}
+
+bool mergeUnits(std::vector<SourceUnit> &units,
+                std::vector<FunctionNode::UPtr> &merged) {
+  bool ok = true;
+  std::unordered_map<std::string, FunctionInfo> functions;
+  std::vector<std::string> order;
+  std::vector<FunctionNode::UPtr> exprs;
+
+  for (auto &unit : units) {
+    ok = ok && unit.ok;
+    for (auto &item : unit.items) {
+      if (item->name().empty()) {
+        exprs.push_back(std::move(item));
+        continue;
+      }
+
+      auto it = functions.find(item->name());
+      if (it == functions.end()) {
+        it = functions.emplace(item->name(), FunctionInfo()).first;
+        order.push_back(item->name());
+      }
+      FunctionInfo &info = it->second;
+
+      FunctionNode *prev = info.def ? info.def.get() : info.decl;
+      const std::string *prevFile = info.def ? info.defFile : info.declFile;
+      if (prev && prev->bufferParams() != item->bufferParams()) {
+        logConflict(unit.fileName,
+                    "conflicting declaration of '" + item->name() + "'",
+                    *prevFile);
+        ok = false;
+        continue;
+      }
+
+      if (item->isDecl()) {
+        if (!info.decl) {
+          info.decl = item.get();
+          info.declFile = &unit.fileName;
+        }
+      } else if (info.def) {
+        logConflict(unit.fileName, "redefinition of '" + item->name() + "'",
+                    *info.defFile);
+        ok = false;
+      } else {
+        info.def = std::move(item);
+        info.defFile = &unit.fileName;
+      }
+    }
+  }
+
+  if (!ok) {
+    return false;
+  }
+
+  for (const auto &name : order) {
+    const FunctionInfo &info = functions[name];
+    FunctionNode *proto = info.def ? info.def.get() : info.decl;
+    merged.push_back(std::make_unique<FunctionNode>(
+        true, name, proto->args(), nullptr, proto->bufferParams()));
+    merged.back()->setPrecedence(proto->precedence());
+  }
+  for (const auto &name : order) {
+    if (functions[name].def) {
+      merged.push_back(std::move(functions[name].def));
+    }
+  }
+  for (auto &expr : exprs) {
+    merged.push_back(std::move(expr));
+  }
+  return true;
+}
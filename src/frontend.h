@@ -0,0 +1,35 @@
+#ifndef FRONTEND_H
+#define FRONTEND_H
+
+#include <string>
+#include <vector>
+
+#include "ast.h"
+#include "parser.h"
+
+// Top-level items parsed from one source file
+struct SourceUnit {
+  std::string fileName;
+  std::vector<FunctionNode::UPtr> items;
+  bool ok = false;
+};
+
+// Lex and parse each file into its own unit, running up to numThreads
+// parsers concurrently. When cacheDir is set, the ASTs are saved there in
+// binary form keyed by a hash of the source, and files whose source did not
+// change are loaded from the cache instead of being parsed. The parsers
+// start with the binary operators of `precedence`.
+std::vector<SourceUnit>
+parseFiles(const std::vector<std::string> &fileNames, unsigned numThreads,
+           const std::string &cacheDir = "",
+           const PrecedenceTable &precedence = kBuiltinPrecedence);
+
+// Merge the parsed units into a single list of items ready for codegen: a
+// prototype for every function first (so calls can refer to functions from
+// any file), then the function definitions, then the top-level
+// expressions, in file order. Returns false if the units redefine a
+// function or declare it with different arities.
+bool mergeUnits(std::vector<SourceUnit> &units,
+                std::vector<FunctionNode::UPtr> &merged);
+
+#endif // FRONTEND_H
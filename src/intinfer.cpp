@@ -0,0 +1,161 @@
+#include <cmath>
+
+#include "intinfer.h"
+
+namespace {
+
+bool isIntegerLiteral(const ExprNode &expr) {
+  auto *numExpr = dynamic_cast<const NumberExprNode *>(&expr);
+  return numExpr && std::trunc(numExpr->num()) == numExpr->num() &&
+         std::fabs(numExpr->num()) <= kMaxExactInteger;
+}
+
+} // namespace
+
+IntegerInference::IntegerInference(
+    const std::unordered_set<std::string> &integerFns, FunctionNode &funcNode,
+    bool integerVersion)
+    : integerFns_(integerFns), integerVersion_(integerVersion) {
+  for (size_t i = 0; i < funcNode.args().size(); ++i) {
+    if (funcNode.isBufferParam(i)) {
+      bufferParams_.insert(funcNode.args()[i]);
+    } else if (integerVersion) {
+      integerParams_.insert(funcNode.args()[i]);
+    }
+  }
+  funcNode.accept(*this);
+}
+
+bool IntegerInference::isBuffer(const ExprNode &expr) const {
+  auto *varExpr = dynamic_cast<const VariableExprNode *>(&expr);
+  return varExpr && bufferParams_.count(varExpr->varName());
+}
+
+bool IntegerInference::infer(ExprNode &expr) {
+  expr.accept(*this);
+  return isInteger(expr);
+}
+
+void IntegerInference::visit(ExprNode &exprNode) { assert(false); }
+
+void IntegerInference::visit(NumberExprNode &numExpr) {
+  if (isIntegerLiteral(numExpr)) {
+    integers_.insert(&numExpr);
+  }
+}
+
+void IntegerInference::visit(VariableExprNode &varExpr) {
+  if (integerParams_.count(varExpr.varName())) {
+    integers_.insert(&varExpr);
+  }
+}
+
+void IntegerInference::visit(BinaryExprNode &binExpr) {
+  auto chain = lhsChain(binExpr);
+  bool lhs = infer(*chain.back()->lhs());
+  for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+    lhs = inferBinary(**it, lhs);
+  }
+}
+
+// Infers binExpr whose lhs was inferred to be an integer or not
+bool IntegerInference::inferBinary(BinaryExprNode &binExpr, bool lhs) {
+  bool rhs = infer(*binExpr.rhs());
+  bool integer = false;
+  switch (binExpr.op()) {
+  case BinaryExprNode::Op::plus:
+  case BinaryExprNode::Op::minus:
+  case BinaryExprNode::Op::mul:
+    // May leave the exact range, which only an integer version can handle
+    integer = integerVersion_ && lhs && rhs;
+    break;
+  case BinaryExprNode::Op::div:
+    break;
+  case BinaryExprNode::Op::mod:
+    // x % 0 is NaN, which has no integer representation
+    integer = lhs && isIntegerLiteral(*binExpr.rhs()) &&
+              static_cast<NumberExprNode *>(binExpr.rhs())->num() != 0;
+    break;
+  case BinaryExprNode::Op::custom:
+    integer = integerVersion_ && lhs && rhs &&
+              integerFns_.count(std::string("binary") + binExpr.opChar());
+    break;
+  }
+  if (integer) {
+    integers_.insert(&binExpr);
+  } else if (binExpr.op() == BinaryExprNode::Op::custom) {
+    callsDoubleVersion_ = true;
+  }
+  return integer;
+}
+
+void IntegerInference::visit(CallExprNode &callExpr) {
+  if (callExpr.callee() == "len" && callExpr.args().size() == 1 &&
+      isBuffer(*callExpr.args()[0])) {
+    integers_.insert(&callExpr);
+    return;
+  }
+
+  // Buffer args are passed the same way to both versions
+  bool integer = integerFns_.count(callExpr.callee()) != 0;
+  for (const auto &arg : callExpr.args()) {
+    integer &= infer(*arg) || isBuffer(*arg);
+  }
+  if (integer) {
+    integerCalls_.insert(&callExpr);
+    // A double version gets the result of the call as a double, since it
+    // may have to call the double version of the callee instead
+    if (integerVersion_) {
+      integers_.insert(&callExpr);
+    }
+  } else {
+    callsDoubleVersion_ = true;
+  }
+}
+
+void IntegerInference::visit(IfElseExprNode &ifelseExpr) {
+  ifelseExpr.condExpr()->accept(*this);
+  bool thenInt = infer(*ifelseExpr.thenExpr());
+  bool elseInt = infer(*ifelseExpr.elseExpr());
+  if (thenInt && elseInt) {
+    integers_.insert(&ifelseExpr);
+  }
+}
+
+void IntegerInference::visit(IndexExprNode &indexExpr) {
+  indexExpr.index()->accept(*this);
+  if (indexExpr.value() && infer(*indexExpr.value())) {
+    integers_.insert(&indexExpr);
+  }
+}
+
+void IntegerInference::visit(FunctionNode &funcNode) {
+  if (funcNode.body()) {
+    funcNode.body()->accept(*this);
+  }
+}
+
+bool inferIntegerVersion(FunctionNode &funcNode,
+                         std::unordered_set<std::string> &integerFns) {
+  if (funcNode.isDecl() || funcNode.name().empty()) {
+    return false;
+  }
+  for (bool isBuffer : funcNode.bufferParams()) {
+    if (isBuffer) {
+      return false;
+    }
+  }
+
+  // Optimistically assume the function has an integer version, which holds
+  // if its body is an integer under that assumption
+  auto inserted = integerFns.insert(funcNode.name());
+  IntegerInference inference(integerFns, funcNode, true);
+  if (inference.isInteger(*funcNode.body()) &&
+      !inference.callsDoubleVersion()) {
+    return true;
+  }
+  if (inserted.second) {
+    integerFns.erase(funcNode.name());
+  }
+  return false;
+}
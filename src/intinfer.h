@@ -0,0 +1,84 @@
+#ifndef INTINFER_H
+#define INTINFER_H
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <unordered_set>
+
+#include "ast.h"
+#include "visitor.h"
+
+// Suffix of the name of a function's integer version, which takes and
+// returns i64 instead of double
+constexpr const char *kIntegerSuffix = ".i64";
+
+// Largest magnitude up to which doubles represent all integers (2^53).
+// Integer arithmetic within it agrees with double arithmetic.
+constexpr int64_t kMaxExactInteger = int64_t(1) << 53;
+
+// Returned by an integer version when its result, or one computed on the
+// way, leaves +/-kMaxExactInteger. Its callers then return it too, up to a
+// double version, which calls the double version of the callee instead.
+constexpr int64_t kIntegerOverflow = std::numeric_limits<int64_t>::min();
+
+// Finds the expressions of a function body which always evaluate to
+// integers, so that they can be computed with i64 arithmetic. Buffer
+// lengths are integers, their elements doubles.
+//
+// In a double version, only the expressions which cannot leave the exact
+// range are integers, and calls with integer args call the integer version
+// but get a double. In an integer version, +, - and * are integers too and
+// are checked against the exact range.
+class IntegerInference : public Visitor {
+public:
+  // `integerFns` are the functions which have an integer version. The
+  // params of `funcNode` are integers in its integer version and doubles in
+  // its double version.
+  IntegerInference(const std::unordered_set<std::string> &integerFns,
+                   FunctionNode &funcNode, bool integerVersion);
+
+  bool isInteger(const ExprNode &expr) const {
+    return integers_.count(&expr) != 0;
+  }
+  // Returns true if `callExpr` calls the integer version of its callee
+  bool callsIntegerVersion(const CallExprNode &callExpr) const {
+    return integerCalls_.count(&callExpr) != 0;
+  }
+  // Returns true if the body calls the double version of a function (or a
+  // user defined operator), which may have side effects
+  bool callsDoubleVersion() const { return callsDoubleVersion_; }
+
+  void visit(ExprNode &exprNode) override;
+  void visit(NumberExprNode &numExpr) override;
+  void visit(VariableExprNode &varExpr) override;
+  void visit(BinaryExprNode &binExpr) override;
+  void visit(CallExprNode &callExpr) override;
+  void visit(IfElseExprNode &ifelseExpr) override;
+  void visit(IndexExprNode &indexExpr) override;
+  void visit(FunctionNode &funcNode) override;
+
+private:
+  bool infer(ExprNode &expr);
+  bool inferBinary(BinaryExprNode &binExpr, bool lhs);
+  bool isBuffer(const ExprNode &expr) const;
+
+  const std::unordered_set<std::string> &integerFns_;
+  bool integerVersion_;
+  std::unordered_set<std::string> integerParams_;
+  std::unordered_set<std::string> bufferParams_;
+  std::unordered_set<const ExprNode *> integers_;
+  std::unordered_set<const ExprNode *> integerCalls_;
+  bool callsDoubleVersion_ = false;
+};
+
+// Returns true, and adds the function to `integerFns`, if the body of
+// `funcNode` is an integer when all its params are integers. Recursive
+// calls with integer args are assumed to return integers. The body is
+// evaluated again by the double version when it overflows, so it must have
+// no side effects: the function takes no buffers, and only calls integer
+// versions, which have none either.
+bool inferIntegerVersion(FunctionNode &funcNode,
+                         std::unordered_set<std::string> &integerFns);
+
+#endif // INTINFER_H
@@ -0,0 +1,363 @@
+#include <iostream>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
+#include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/Object/SymbolSize.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "jit.h"
+#include "runtime.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+namespace {
+
+void logError(Error err) {
+  std::cerr << "error: " << toString(std::move(err)) << std::endl;
+}
+
+// Writes perf's map file format: "<start> <size> <name>" in hex, one line
+// per function.
+class PerfMapListener : public JITEventListener {
+public:
+  PerfMapListener()
+      : out_("/tmp/perf-" + std::to_string(sys::Process::getProcessId()) +
+                 ".map",
+             errorCode_, sys::fs::OF_Append) {
+    if (errorCode_) {
+      std::cerr << "error: cannot open perf map: " << errorCode_.message()
+                << std::endl;
+    }
+  }
+
+  void notifyObjectLoaded(ObjectKey key, const object::ObjectFile &obj,
+                          const RuntimeDyld::LoadedObjectInfo &info) override {
+    if (errorCode_) {
+      return;
+    }
+
+    // The debug object has the symbols relocated to their load addresses
+    object::OwningBinary<object::ObjectFile> debugObj =
+        info.getObjectForDebug(obj);
+    if (!debugObj.getBinary()) {
+      return;
+    }
+
+    for (const auto &symAndSize :
+         object::computeSymbolSizes(*debugObj.getBinary())) {
+      const object::SymbolRef &sym = symAndSize.first;
+      Expected<object::SymbolRef::Type> type = sym.getType();
+      Expected<StringRef> name = sym.getName();
+      Expected<uint64_t> addr = sym.getAddress();
+      if (!type || !name || !addr) {
+        consumeError(type.takeError());
+        consumeError(name.takeError());
+        consumeError(addr.takeError());
+        continue;
+      }
+      if (*type != object::SymbolRef::ST_Function) {
+        continue;
+      }
+      out_ << format("%llx %llx ", *addr, symAndSize.second) << *name << "\n";
+    }
+    out_.flush();
+  }
+
+private:
+  std::error_code errorCode_;
+  raw_fd_ostream out_;
+};
+
+// Counts the bytes allocated for the sections of the object it loads
+class CountingMemoryManager : public SectionMemoryManager {
+public:
+  explicit CountingMemoryManager(std::atomic<size_t> &bytes) : bytes_(bytes) {}
+  ~CountingMemoryManager() override { bytes_ -= allocated_; }
+
+  uint8_t *allocateCodeSection(uintptr_t size, unsigned alignment,
+                               unsigned sectionID,
+                               StringRef sectionName) override {
+    count(size);
+    return SectionMemoryManager::allocateCodeSection(size, alignment,
+                                                     sectionID, sectionName);
+  }
+
+  uint8_t *allocateDataSection(uintptr_t size, unsigned alignment,
+                               unsigned sectionID, StringRef sectionName,
+                               bool isReadOnly) override {
+    count(size);
+    return SectionMemoryManager::allocateDataSection(
+        size, alignment, sectionID, sectionName, isReadOnly);
+  }
+
+private:
+  void count(uintptr_t size) {
+    allocated_ += size;
+    bytes_ += size;
+  }
+
+  std::atomic<size_t> &bytes_;
+  size_t allocated_ = 0;
+};
+
+// Symbols a module expects another module (or the host process) to define
+std::vector<std::string> collectUses(Module &module) {
+  std::vector<std::string> uses;
+  for (GlobalValue &gv : module.global_values()) {
+    if (gv.isDeclaration() && !gv.use_empty() &&
+        !gv.getName().startswith("llvm.")) {
+      uses.push_back(gv.getName().str());
+    }
+  }
+  return uses;
+}
+
+} // namespace
+
+std::unique_ptr<KaleidoscopeJIT>
+KaleidoscopeJIT::create(const JitOptions &options) {
+  std::unique_ptr<KaleidoscopeJIT> jit(new KaleidoscopeJIT(options));
+  std::atomic<size_t> *codeBytes = &jit->codeBytes_;
+
+  if (options.perfMap) {
+    jit->perfMapListener_ = std::make_unique<PerfMapListener>();
+    jit->listeners_.push_back(jit->perfMapListener_.get());
+  }
+  if (options.perfJitDump) {
+    if (JITEventListener *listener =
+            JITEventListener::createPerfJITEventListener()) {
+      jit->listeners_.push_back(listener);
+    } else {
+      std::cerr << "error: llvm was built without perf jitdump support"
+                << std::endl;
+    }
+  }
+  if (options.gdbRegistration) {
+    jit->listeners_.push_back(
+        JITEventListener::createGDBRegistrationListener());
+  }
+
+  auto lljit =
+      LLJITBuilder()
+          .setObjectLinkingLayerCreator(
+              [&jit, codeBytes](ExecutionSession &session, const Triple &) {
+                auto layer = std::make_unique<RTDyldObjectLinkingLayer>(
+                    session, [codeBytes]() {
+                      return std::make_unique<CountingMemoryManager>(
+                          *codeBytes);
+                    });
+                for (JITEventListener *listener : jit->listeners_) {
+                  layer->registerJITEventListener(*listener);
+                }
+                return layer;
+              })
+          .create();
+  if (!lljit) {
+    logError(lljit.takeError());
+    return nullptr;
+  }
+  jit->lljit_ = std::move(*lljit);
+
+  // Resolve externs (e.g. libm functions) against the host process
+  auto processSymbols = DynamicLibrarySearchGenerator::GetForCurrentProcess(
+      jit->getDataLayout().getGlobalPrefix());
+  if (!processSymbols) {
+    logError(processSymbols.takeError());
+    return nullptr;
+  }
+  jit->lljit_->getMainJITDylib().addGenerator(std::move(*processSymbols));
+
+  // klc is not linked to export the fork-join runtime of -fparallel-calls
+  MangleAndInterner mangle(jit->lljit_->getExecutionSession(),
+                           jit->getDataLayout());
+  SymbolMap runtime;
+  runtime[mangle("klc_should_spawn")] = JITEvaluatedSymbol(
+      pointerToJITTargetAddress(&klc_should_spawn), JITSymbolFlags::Exported);
+  runtime[mangle("klc_spawn")] = JITEvaluatedSymbol(
+      pointerToJITTargetAddress(&klc_spawn), JITSymbolFlags::Exported);
+  runtime[mangle("klc_join")] = JITEvaluatedSymbol(
+      pointerToJITTargetAddress(&klc_join), JITSymbolFlags::Exported);
+  if (Error err = jit->lljit_->getMainJITDylib().define(
+          absoluteSymbols(std::move(runtime)))) {
+    logError(std::move(err));
+    return nullptr;
+  }
+  return jit;
+}
+
+bool KaleidoscopeJIT::addObject(std::unique_ptr<MemoryBuffer> object) {
+  if (Error err = lljit_->addObjectFile(std::move(object))) {
+    logError(std::move(err));
+    return false;
+  }
+  return true;
+}
+
+bool KaleidoscopeJIT::addModule(ThreadSafeModule module) {
+  if (!options_.codeLimit) {
+    return addTrackedModule(std::move(module), nullptr);
+  }
+
+  ModuleRecord record;
+  std::vector<std::string> defines;
+  module.withModuleDo([&](Module &m) {
+    record.uses = collectUses(m);
+    for (GlobalValue &gv : m.global_values()) {
+      if (!gv.isDeclaration() && !gv.hasLocalLinkage() &&
+          !gv.getName().startswith("llvm.")) {
+        defines.push_back(gv.getName().str());
+      }
+    }
+    // Compiling it again would reset its variables (e.g. profile counters)
+    for (GlobalVariable &var : m.globals()) {
+      record.pinned |= !var.isDeclaration() && !var.isConstant();
+    }
+    // The IR is freed once compiled, keep a copy to compile it again
+    raw_svector_ostream out(record.bitcode);
+    WriteBitcodeToFile(m, out);
+  });
+  ++clock_;
+  if (!restore(record.uses, module.getContext())) {
+    return false;
+  }
+
+  irBytes_ += record.bitcode.size();
+  record.tracker = lljit_->getMainJITDylib().createResourceTracker();
+  record.lastUse = clock_;
+  ResourceTrackerSP tracker = record.tracker;
+  for (std::string &name : defines) {
+    definedIn_[std::move(name)] = modules_.size();
+  }
+  modules_.push_back(std::move(record));
+  return addTrackedModule(std::move(module), std::move(tracker));
+}
+
+ResourceTrackerSP KaleidoscopeJIT::addTemporaryModule(ThreadSafeModule module) {
+  if (options_.codeLimit) {
+    std::vector<std::string> uses;
+    module.withModuleDo([&](Module &m) { uses = collectUses(m); });
+    ++clock_;
+    if (!restore(uses, module.getContext())) {
+      return nullptr;
+    }
+  }
+
+  ResourceTrackerSP tracker = lljit_->getMainJITDylib().createResourceTracker();
+  if (!addTrackedModule(std::move(module), tracker)) {
+    return nullptr;
+  }
+  return tracker;
+}
+
+void KaleidoscopeJIT::removeModule(ResourceTrackerSP tracker) {
+  if (Error err = tracker->remove()) {
+    logError(std::move(err));
+  }
+}
+
+bool KaleidoscopeJIT::addTrackedModule(ThreadSafeModule module,
+                                       ResourceTrackerSP tracker) {
+  Error err = tracker
+                  ? lljit_->addIRModule(std::move(tracker), std::move(module))
+                  : lljit_->addIRModule(std::move(module));
+  if (err) {
+    logError(std::move(err));
+    return false;
+  }
+  return true;
+}
+
+bool KaleidoscopeJIT::restore(const std::vector<std::string> &uses,
+                              ThreadSafeContext context) {
+  for (const std::string &name : uses) {
+    auto it = definedIn_.find(name);
+    if (it == definedIn_.end()) {
+      // Resolved against the host process
+      continue;
+    }
+
+    ModuleRecord &record = modules_[it->second];
+    if (record.tracker && record.lastUse == clock_) {
+      // Already visited
+      continue;
+    }
+    record.lastUse = clock_;
+
+    if (!record.tracker) {
+      MemoryBufferRef buffer(
+          StringRef(record.bitcode.data(), record.bitcode.size()), name);
+      auto module = parseBitcodeFile(buffer, *context.getContext());
+      if (!module) {
+        logError(module.takeError());
+        return false;
+      }
+      record.tracker = lljit_->getMainJITDylib().createResourceTracker();
+      if (!addTrackedModule(ThreadSafeModule(std::move(*module), context),
+                            record.tracker)) {
+        return false;
+      }
+    }
+
+    if (!restore(record.uses, context)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void KaleidoscopeJIT::evictColdModules() {
+  while (options_.codeLimit && codeBytes_ > options_.codeLimit) {
+    // The code of a module used by a compiled module refers to it
+    std::vector<bool> used(modules_.size(), false);
+    for (const ModuleRecord &record : modules_) {
+      if (!record.tracker) {
+        continue;
+      }
+      for (const std::string &name : record.uses) {
+        auto it = definedIn_.find(name);
+        if (it != definedIn_.end()) {
+          used[it->second] = true;
+        }
+      }
+    }
+
+    ModuleRecord *coldest = nullptr;
+    for (size_t i = 0; i < modules_.size(); ++i) {
+      ModuleRecord &record = modules_[i];
+      if (record.tracker && !record.pinned && !used[i] &&
+          (!coldest || record.lastUse < coldest->lastUse)) {
+        coldest = &record;
+      }
+    }
+    if (!coldest) {
+      return;
+    }
+    removeModule(std::move(coldest->tracker));
+    coldest->tracker = nullptr;
+  }
+}
+
+uint64_t KaleidoscopeJIT::lookup(const std::string &name) {
+  auto sym = lljit_->lookup(name);
+  if (!sym) {
+    logError(sym.takeError());
+    return 0;
+  }
+  return sym->getAddress();
+}
+
+void KaleidoscopeJIT::runInitializers() {
+  if (Error err = lljit_->initialize(lljit_->getMainJITDylib())) {
+    logError(std::move(err));
+  }
+}
+
+void KaleidoscopeJIT::runDeinitializers() {
+  if (Error err = lljit_->deinitialize(lljit_->getMainJITDylib())) {
+    logError(std::move(err));
+  }
+}
@@ -0,0 +1,102 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct JitOptions {
+  // Append the address, size and name of every compiled function to
+  // /tmp/perf-<pid>.map, which perf uses to symbolize JIT code.
+  bool perfMap = false;
+  // Write a jitdump file (with line tables when compiled with debug info)
+  // for `perf record -k 1` + `perf inject --jit`.
+  bool perfJitDump = false;
+  // Register compiled objects with GDB's JIT interface
+  bool gdbRegistration = false;
+  // When not 0, evictColdModules() frees compiled modules until the JIT
+  // code takes at most this many bytes. Evicted modules are kept as
+  // bitcode and compiled again when referenced.
+  size_t codeLimit = 0;
+};
+
+// In-process compiler for the modules produced by Codegen
+class KaleidoscopeJIT {
+public:
+  // Returns nullptr (after reporting why) if the host is not supported
+  static std::unique_ptr<KaleidoscopeJIT> create(const JitOptions &options);
+
+  const llvm::DataLayout &getDataLayout() const {
+    return lljit_->getDataLayout();
+  }
+
+  // Add a module, it is compiled when one of its symbols is looked up
+  bool addModule(llvm::orc::ThreadSafeModule module);
+  // Add a module to be freed with removeModule() once it was run. Nothing
+  // may refer to its symbols.
+  llvm::orc::ResourceTrackerSP
+  addTemporaryModule(llvm::orc::ThreadSafeModule module);
+  void removeModule(llvm::orc::ResourceTrackerSP tracker);
+  // Add a compiled object, which is never evicted. Its buffer must outlive
+  // the JIT.
+  bool addObject(std::unique_ptr<llvm::MemoryBuffer> object);
+
+  // Returns the address of a compiled symbol, or 0 if it is unknown
+  uint64_t lookup(const std::string &name);
+
+  // Run the global constructors / destructors of the added modules
+  void runInitializers();
+  void runDeinitializers();
+
+  // Free the least recently used modules which no compiled module refers
+  // to, until the code is within the codeLimit option.
+  void evictColdModules();
+
+  // Memory held for the code and data sections of the compiled modules
+  size_t codeBytes() const { return codeBytes_; }
+  // Memory held for the bitcode of the modules which can be evicted
+  size_t irBytes() const { return irBytes_; }
+
+private:
+  // A module added with addModule(), tracked when eviction is enabled
+  struct ModuleRecord {
+    // Null while the module is evicted
+    llvm::orc::ResourceTrackerSP tracker;
+    std::vector<std::string> uses;
+    llvm::SmallVector<char, 0> bitcode;
+    // Never evicted
+    bool pinned = false;
+    // Value of clock_ the last time a temporary module used the module
+    uint64_t lastUse = 0;
+  };
+
+  KaleidoscopeJIT(const JitOptions &options) : options_(options) {}
+
+  bool addTrackedModule(llvm::orc::ThreadSafeModule module,
+                        llvm::orc::ResourceTrackerSP tracker);
+  // Compile the evicted modules defining `uses` again, and mark the
+  // modules they use (transitively) as used now
+  bool restore(const std::vector<std::string> &uses,
+               llvm::orc::ThreadSafeContext context);
+
+  // Declared before lljit_, which uses them until it is destroyed
+  JitOptions options_;
+  std::atomic<size_t> codeBytes_{0};
+  std::vector<llvm::JITEventListener *> listeners_;
+  std::unique_ptr<llvm::JITEventListener> perfMapListener_;
+  std::unique_ptr<llvm::orc::LLJIT> lljit_;
+  size_t irBytes_ = 0;
+
+  std::vector<ModuleRecord> modules_;
+  // Index in modules_ of the module defining a symbol
+  std::unordered_map<std::string, size_t> definedIn_;
+  uint64_t clock_ = 0;
+};
+
+#endif // JIT_H
@@ -1,15 +1,245 @@
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
+#include "codegen.h"
+#include "frontend.h"
 #include "lexer.h"
 #include "parser.h"
 
+namespace {
+
+constexpr unsigned kDefaultSpecializeBudget = 1000;
+
+// Returns the value of option `name` if `arg` is of the form name=value
+const char *optionValue(const char *arg, const char *name) {
+  size_t len = strlen(name);
+  if (strncmp(arg, name, len) == 0 && arg[len] == '=') {
+    return arg + len + 1;
+  }
+  return nullptr;
+}
+
+// Parses the value of a numeric option, returns false unless `val` is a
+// decimal number which fits in `num`
+template <typename T> bool parseNumber(const char *val, T &num) {
+  char *end;
+  errno = 0;
+  unsigned long long n = std::strtoull(val, &end, 10);
+  if (!isdigit(uint8_t(*val)) || *end || errno ||
+      n > std::numeric_limits<T>::max()) {
+    return false;
+  }
+  num = T(n);
+  return true;
+}
+
+bool parseVecLib(const std::string &name,
+                 llvm::TargetLibraryInfoImpl::VectorLibrary &vecLib) {
+  using TLII = llvm::TargetLibraryInfoImpl;
+  const std::pair<const char *, TLII::VectorLibrary> vecLibs[] = {
+      {"none", TLII::NoLibrary},
+      {"libmvec", TLII::LIBMVEC_X86},
+      {"SVML", TLII::SVML},
+      {"MASSV", TLII::MASSV},
+      {"Accelerate", TLII::Accelerate},
+      {"Darwin_libsystem_m", TLII::DarwinLibSystemM},
+  };
+  for (const auto &entry : vecLibs) {
+    if (name == entry.first) {
+      vecLib = entry.second;
+      return true;
+    }
+  }
+  return false;
+}
+
+void usage() {
+  std::cerr << "usage: klc [options] [files...]\n"
+            << "  reads standard input interactively when no file is given\n"
+            << "  -threads=<n>               parse files on <n> threads\n"
+            << "  -ast-cache=<dir>           cache parsed files in <dir>\n"
+            << "  -prelude=<file>            load the functions of snapshot "
+               "<file>\n"
+            << "  -prelude-snapshot=<file>   compile the files into snapshot "
+               "<file>\n"
+            << "  -fprofile-generate=<file>  instrument code, write profile "
+               "to <file> at exit\n"
+            << "  -fprofile-use=<file>       optimize using profile <file>\n"
+            << "  -fspecialize[=<budget>]    clone functions for constant "
+               "call arguments,\n"
+            << "                             adding at most <budget> "
+               "instructions (default "
+            << kDefaultSpecializeBudget << ")\n"
+            << "  -fdedup                    merge identical functions and "
+               "subexpressions\n"
+            << "  -finteger-inference        compile integer code with i64 "
+               "arithmetic\n"
+            << "  -fparallel-calls           run expensive pure calls as "
+               "parallel tasks\n"
+            << "  -g                         emit debug info\n"
+            << "  -jit                       compile with the JIT and "
+               "evaluate top-level\n"
+            << "                             expressions\n"
+            << "  -jit-perf-map              write /tmp/perf-<pid>.map for "
+               "JIT code\n"
+            << "  -jit-perf-dump             write a perf jitdump for JIT "
+               "code\n"
+            << "  -jit-gdb                   register JIT code with gdb\n"
+            << "  -jit-memory-report         print the memory used after "
+               "each evaluation\n"
+            << "  -jit-code-limit=<bytes>    evict cold functions when JIT "
+               "code exceeds\n"
+            << "                             <bytes>\n"
+            << "  -fveclib=<lib>             vector math library: none, "
+               "libmvec, SVML,\n"
+            << "                             MASSV, Accelerate, "
+               "Darwin_libsystem_m"
+            << std::endl;
+}
+
+int invalidValue(const char *arg) {
+  std::cerr << "error: invalid value in option '" << arg << "'" << std::endl;
+  usage();
+  return 1;
+}
+
+// Parse all files in parallel, then generate code for the merged items.
+// When snapshotFile is set, the files are a prelude compiled into it.
+int compileFiles(const std::vector<std::string> &fileNames, Codegen &cg,
+                 unsigned numThreads, const std::string &astCacheDir,
+                 const PrecedenceTable &precedence,
+                 const std::string &snapshotFile) {
+  std::vector<SourceUnit> units =
+      parseFiles(fileNames, numThreads, astCacheDir, precedence);
+  std::vector<FunctionNode::UPtr> items;
+  if (!mergeUnits(units, items)) {
+    return 1;
+  }
+  if (!snapshotFile.empty() && !items.empty() && items.back()->name().empty()) {
+    std::cerr << "error: a prelude cannot have top-level expressions"
+              << std::endl;
+    return 1;
+  }
+  for (auto &item : items) {
+    item->accept(cg);
+    cg.evaluateTopLevelExpr();
+    item.reset();
+  }
+  cg.finalizeModule();
+  if (!snapshotFile.empty()) {
+    return cg.writeSnapshot(snapshotFile) ? 0 : 1;
+  }
+  cg.printModule();
+  cg.shutdown();
+  return 0;
+}
+
+} // namespace
+
 int
-main() {
+main(int argc, char *argv[]) {
+  CodegenOptions options;
+  std::vector<std::string> fileNames;
+  unsigned numThreads = std::thread::hardware_concurrency();
+  std::string astCacheDir;
+  std::string preludeFile;
+  std::string snapshotFile;
+  for (int i = 1; i < argc; ++i) {
+    if (argv[i][0] != '-') {
+      fileNames.push_back(argv[i]);
+    } else if (const char *val = optionValue(argv[i], "-threads")) {
+      if (!parseNumber(val, numThreads)) {
+        return invalidValue(argv[i]);
+      }
+    } else if (const char *val = optionValue(argv[i], "-ast-cache")) {
+      astCacheDir = val;
+    } else if (const char *val = optionValue(argv[i], "-prelude")) {
+      preludeFile = val;
+    } else if (const char *val = optionValue(argv[i], "-prelude-snapshot")) {
+      snapshotFile = val;
+    } else if (const char *val = optionValue(argv[i], "-fprofile-generate")) {
+      options.profileGenerate = val;
+    } else if (const char *val = optionValue(argv[i], "-fprofile-use")) {
+      options.profileUse = val;
+    } else if (strcmp(argv[i], "-fspecialize") == 0) {
+      options.specializeBudget = kDefaultSpecializeBudget;
+    } else if (const char *val = optionValue(argv[i], "-fspecialize")) {
+      if (!parseNumber(val, options.specializeBudget)) {
+        return invalidValue(argv[i]);
+      }
+    } else if (strcmp(argv[i], "-fdedup") == 0) {
+      options.dedup = true;
+    } else if (strcmp(argv[i], "-finteger-inference") == 0) {
+      options.integerInference = true;
+    } else if (strcmp(argv[i], "-fparallel-calls") == 0) {
+      options.parallelCalls = true;
+    } else if (strcmp(argv[i], "-g") == 0) {
+      options.debugInfo = true;
+    } else if (strcmp(argv[i], "-jit") == 0) {
+      options.jit = true;
+    } else if (strcmp(argv[i], "-jit-perf-map") == 0) {
+      options.jitOptions.perfMap = true;
+    } else if (strcmp(argv[i], "-jit-perf-dump") == 0) {
+      options.jitOptions.perfJitDump = true;
+    } else if (strcmp(argv[i], "-jit-gdb") == 0) {
+      options.jitOptions.gdbRegistration = true;
+    } else if (strcmp(argv[i], "-jit-memory-report") == 0) {
+      options.memoryReport = true;
+    } else if (const char *val = optionValue(argv[i], "-jit-code-limit")) {
+      if (!parseNumber(val, options.jitOptions.codeLimit)) {
+        return invalidValue(argv[i]);
+      }
+    } else if (const char *val = optionValue(argv[i], "-fveclib")) {
+      if (!parseVecLib(val, options.vecLib)) {
+        std::cerr << "error: unknown vector library '" << val << "'"
+                  << std::endl;
+        return 1;
+      }
+    } else {
+      std::cerr << "error: unknown option '" << argv[i] << "'" << std::endl;
+      usage();
+      return 1;
+    }
+  }
+
+  if (!snapshotFile.empty() &&
+      (fileNames.empty() || !preludeFile.empty() || options.jit)) {
+    std::cerr << "error: -prelude-snapshot needs files, and no -prelude or "
+                 "-jit"
+              << std::endl;
+    return 1;
+  }
+
+  Codegen cg{ options };
+  if (!preludeFile.empty() && !cg.loadSnapshot(preludeFile)) {
+    return 1;
+  }
+  // The prelude's operators parse like the ones defined in the input
+  PrecedenceTable precedence = kBuiltinPrecedence;
+  for (const auto &op : cg.binaryOps()) {
+    if (uint8_t(op.first) < kNumOpTokens) {
+      precedence.prec[uint8_t(op.first)] = op.second;
+    }
+  }
+
+  if (!fileNames.empty()) {
+    return compileFiles(fileNames, cg, numThreads, astCacheDir, precedence,
+                        snapshotFile);
+  }
+
   Lexer lex{ std::cin };
-  Parser parser{ lex };
+  Parser parser{ lex, "<stdin>", precedence };
 
   std::cout << "kscope>";
-  parser.parse();
+  parser.parse(cg);
 
   return 0;
 }
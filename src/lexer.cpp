@@ -1,18 +1,28 @@
-#include <limits>
-
 #include "lexer.h"
 
+void Lexer::advance() {
+  if (currChar_ == '\n') {
+    ++line_;
+    col_ = 0;
+  }
+  currChar_ = in_.get();
+  ++col_;
+}
+
 int Lexer::getToken() {
   while (isspace(currChar_)) {
-    currChar_ = in_.get();
+    advance();
   }
 
+  tokenLoc_.line = line_;
+  tokenLoc_.col = col_;
+
   if (isalpha(currChar_)) {
     identifierStr_ = currChar_;
-    currChar_ = in_.get();
+    advance();
     while (isalnum(currChar_)) {
       identifierStr_.push_back(currChar_);
-      currChar_ = in_.get();
+      advance();
     }
 
     if (identifierStr_ == "def") {
@@ -30,6 +40,9 @@ int Lexer::getToken() {
     if (identifierStr_ == "else") {
       return ELSE;
     }
+    if (identifierStr_ == "binary") {
+      return BINARY;
+    }
     return IDENT;
   }
 
@@ -37,14 +50,17 @@ int Lexer::getToken() {
     std::string numStr;
     do {
       numStr.push_back(currChar_);
-      currChar_ = in_.get();
+      advance();
     } while (isdigit(currChar_) || currChar_ == '.');
     numberVal_ = stod(numStr);
     return NUMBER;
   }
 
   if (currChar_ == '#') {
-    in_.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    // Comment until end of line
+    do {
+      advance();
+    } while (!in_.eof() && currChar_ != '\n');
     if (in_.eof()) {
       return EOF_TOK;
     }
@@ -55,6 +71,6 @@ int Lexer::getToken() {
     return EOF_TOK;
   }
   char tok = currChar_;
-  currChar_ = in_.get();
+  advance();
   return tok;
 }
@@ -16,6 +16,14 @@ enum Token {
   IF = -6,
   THEN = -7,
   ELSE = -8,
+
+  BINARY = -9,
+};
+
+// Position in the source, lines and columns are 1 based
+struct SourceLocation {
+  unsigned line = 0;
+  unsigned col = 0;
 };
 
 class Lexer {
@@ -25,12 +33,20 @@ public:
 
   std::string identifierStr() const { return identifierStr_; }
   double numberVal() const { return numberVal_; }
+  // Location of the first character of the last token
+  SourceLocation tokenLoc() const { return tokenLoc_; }
 
 private:
+  // Read the next character into currChar_, tracking its location
+  void advance();
+
   char currChar_;
   std::string identifierStr_;
   double numberVal_;
   std::istream in_;
+  unsigned line_ = 1;
+  unsigned col_ = 0;
+  SourceLocation tokenLoc_;
 };
 
 #endif // LEXER_H
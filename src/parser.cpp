@@ -1,4 +1,8 @@
+#include <algorithm>
+#include <cassert>
+#include <cctype>
 #include <iostream>
+#include <iterator>
 
 #include "codegen.h"
 #include "parser.h"
@@ -7,245 +11,416 @@
 numberexpr -> NUMBER
 identexpr -> IDENT
            | IDENT '(' ( (expression ',')* expression )? ')'
+           | IDENT '[' expression ']' ( '=' expression )?
 parenexpr -> '(' expression ')'
 ifelseExpr -> 'if' expression 'then' expression 'else' expression
 primaryexpr -> numberexpr
              | identexpr
              | parenexpr
              | ifelseExpr
-expression -> primaryexpr binoprhs
-binoprhs -> (( '+' | '-' | '*' | '/' | '%' ) primaryexpr)*
-function -> 'def' IDENT '(' IDENT* ')' expression
-          | 'extern' IDENT '(' IDENT* ')'
+expression -> primaryexpr (BINOP primaryexpr)*
+param -> IDENT | IDENT '[' ']'
+prototype -> IDENT '(' param* ')'
+           | 'binary' CHAR NUMBER? '(' IDENT IDENT ')'
+function -> 'def' prototype expression
+          | 'extern' prototype
 main -> function | expression | ';'
- */
 
-void Parser::initializeBinOpPrecedence() {
-  binOpPrecedence_[BinaryExprNode::Op::minus] = 10;
-  binOpPrecedence_[BinaryExprNode::Op::plus] = 20;
-  binOpPrecedence_[BinaryExprNode::Op::mul] = 30;
-  binOpPrecedence_[BinaryExprNode::Op::div] = 40;
-  binOpPrecedence_[BinaryExprNode::Op::mod] = 50; // highest
-}
+BINOP is one of '+' '-' (precedence 20), '*' '/' '%' (40), or a character
+defined as a binary operator; all of them are left associative.
+ */
 
-int Parser::getTokPrecedence() {
-  switch (currToken_) {
-  case '+':
-    return binOpPrecedence_[BinaryExprNode::Op::plus];
-    break;
-  case '-':
-    return binOpPrecedence_[BinaryExprNode::Op::minus];
-    break;
-  case '*':
-    return binOpPrecedence_[BinaryExprNode::Op::mul];
-    break;
-  case '/':
-    return binOpPrecedence_[BinaryExprNode::Op::div];
-    break;
-  case '%':
-    return binOpPrecedence_[BinaryExprNode::Op::mod];
-    break;
-  default:
-    return -1;
-    break;
+namespace {
+
+// An expression parseExpr() has started but not finished, its finished
+// subexpressions are on the operand stack
+struct ExprFrame {
+  enum Kind {
+    // Operator whose rhs is being parsed, its lhs is on the operand stack
+    binOp,
+    paren,
+    // Call whose args from firstOperand on are on the operand stack, and
+    // whose callee is on top of the name stack
+    call,
+    // Buffer element whose index, or assigned value, is being parsed. The
+    // buffer is on top of the name stack.
+    index,
+    store,
+    // If/then/else whose condition, then or else expression is being parsed
+    ifCond,
+    ifThen,
+    ifElse,
+  };
+
+  Kind kind;
+  SourceLocation loc;
+  char op = 0;
+  int prec = 0;
+  size_t firstOperand = 0;
+};
+
+} // namespace
+
+bool Parser::addBinaryOp(int op, int prec) {
+  // Characters which already have a meaning in expressions
+  const std::string reserved = "(),;#.[]=";
+  if (op < 0 || op >= kNumOpTokens || !ispunct(op) ||
+      reserved.find(op) != std::string::npos || kBuiltinPrecedence.prec[op]) {
+    return false;
   }
+  precedence_.prec[op] = prec;
+  return true;
 }
 
 void Parser::logError(const char *msg) {
-  std::cerr << "error: " << msg << std::endl;
+  hadError_ = true;
+  SourceLocation loc = currLoc();
+  std::cerr << sourceName_ << ":" << loc.line << ":" << loc.col
+            << ": error: " << msg << std::endl;
   return;
 }
 
 ExprNode::UPtr Parser::parseNumberExpr() {
   auto numExpr = std::make_unique<NumberExprNode>(currNum());
+  numExpr->setLoc(currLoc());
 
   // consume NUMBER
   getNextToken();
   return std::move(numExpr);
 }
 
-ExprNode::UPtr Parser::parseParenExpr() {
-  // consume '('
-  getNextToken();
-
-  auto expr = parseExpr();
-  if (!expr) {
-    return nullptr;
-  }
-
-  if (currToken() != ')') {
-    logError("expected ')'");
-    return nullptr;
-  }
-
-  // consume ')'
-  getNextToken();
-  return std::move(expr);
-}
-
-ExprNode::UPtr Parser::parseIdentExpr() {
-  std::string identStr = currIdentifier();
+// Operator precedence parser keeping the unfinished expressions on explicit
+// stacks instead of recursing. The passes over the AST do recurse into
+// subexpressions, so nesting deeper than kMaxExprDepth is rejected. They walk
+// the lhs of a chain of operators in a loop, so the chain does not nest.
+ExprNode::UPtr Parser::parseExpr() {
+  std::vector<ExprNode::UPtr> operands;
+  // Depth of the tree of each operand
+  std::vector<unsigned> depths;
+  std::vector<ExprFrame> frames;
+  std::vector<std::string> names;
+
+  // Pops an operand, keeping the depth of the deepest one popped in
+  // childDepth
+  auto popOperand = [&](unsigned &childDepth) {
+    childDepth = std::max(childDepth, depths.back());
+    depths.pop_back();
+    auto expr = std::move(operands.back());
+    operands.pop_back();
+    return expr;
+  };
+  // Pushes a node whose deepest child has depth childDepth, unless the
+  // tree gets deeper than kMaxExprDepth
+  auto pushOperand = [&](ExprNode::UPtr expr, unsigned childDepth) {
+    if (childDepth >= kMaxExprDepth) {
+      logError("expression nested too deeply");
+      return false;
+    }
+    operands.push_back(std::move(expr));
+    depths.push_back(childDepth + 1);
+    return true;
+  };
+
+  // Build the nodes of the operators on top of the stack that bind at
+  // least as tightly as minPrec
+  auto reduce = [&](int minPrec) {
+    while (!frames.empty() && frames.back().kind == ExprFrame::binOp &&
+           frames.back().prec >= minPrec) {
+      unsigned childDepth = 0;
+      auto rhs = popOperand(childDepth);
+      // A binary lhs is on the same level as the node built here
+      bool lhsInChain = dynamic_cast<BinaryExprNode *>(operands.back().get());
+      unsigned lhsDepth = 0;
+      auto lhs = popOperand(lhsDepth);
+      childDepth = std::max(childDepth, lhsInChain ? lhsDepth - 1 : lhsDepth);
+      auto binExpr = std::make_unique<BinaryExprNode>(
+          frames.back().op, std::move(lhs), std::move(rhs));
+      binExpr->setLoc(frames.back().loc);
+      if (!pushOperand(std::move(binExpr), childDepth)) {
+        return false;
+      }
+      frames.pop_back();
+    }
+    return true;
+  };
 
-  // consume IDENT
-  getNextToken();
+  bool expectOperand = true;
+  while (true) {
+    int tok = currToken();
+    SourceLocation loc = currLoc();
+
+    if (expectOperand) {
+      ExprFrame frame;
+      frame.loc = loc;
+      switch (tok) {
+      case NUMBER:
+        pushOperand(parseNumberExpr(), 0);
+        expectOperand = false;
+        break;
+      case IDENT: {
+        std::string identStr = currIdentifier();
+        // consume IDENT
+        getNextToken();
+
+        if (currToken() == '[') {
+          // consume '['
+          getNextToken();
+          frame.kind = ExprFrame::index;
+          frames.push_back(frame);
+          names.push_back(std::move(identStr));
+          break;
+        }
+
+        if (currToken() != '(') {
+          auto varExpr = std::make_unique<VariableExprNode>(identStr);
+          varExpr->setLoc(loc);
+          pushOperand(std::move(varExpr), 0);
+          expectOperand = false;
+          break;
+        }
+
+        // consume '('
+        getNextToken();
+        frame.kind = ExprFrame::call;
+        frame.firstOperand = operands.size();
+        frames.push_back(frame);
+        names.push_back(std::move(identStr));
+        // An empty argument list is closed right away
+        expectOperand = currToken() != ')';
+      } break;
+      case '(':
+        // consume '('
+        getNextToken();
+        frame.kind = ExprFrame::paren;
+        frames.push_back(frame);
+        break;
+      case IF:
+        // consume 'if'
+        getNextToken();
+        frame.kind = ExprFrame::ifCond;
+        frames.push_back(frame);
+        break;
+      default:
+        logError("unknown token while parsing expression");
+        return nullptr;
+      }
+      continue;
+    }
 
-  if (currToken() != '(') {
-    return std::make_unique<VariableExprNode>(identStr);
-  }
+    if (int prec = tokPrecedence(tok)) {
+      // Left associative: the operators on the stack with the same
+      // precedence take the operand
+      if (!reduce(prec)) {
+        return nullptr;
+      }
+      ExprFrame frame;
+      frame.kind = ExprFrame::binOp;
+      frame.loc = loc;
+      frame.op = tok;
+      frame.prec = prec;
+      frames.push_back(frame);
+      // consume bin op
+      getNextToken();
+      expectOperand = true;
+      continue;
+    }
 
-  // consume '('
-  getNextToken();
+    // Not an operator: the innermost unfinished expression ends here
+    if (!reduce(1)) {
+      return nullptr;
+    }
+    if (frames.empty()) {
+      return std::move(operands.back());
+    }
 
-  std::vector<ExprNode::UPtr> args;
-  if (currToken() != ')') {
-    while (true) {
-      auto arg = parseExpr();
-      if (arg) {
-        args.push_back(std::move(arg));
-      } else {
+    ExprFrame &frame = frames.back();
+    switch (frame.kind) {
+    case ExprFrame::paren:
+      if (tok != ')') {
+        logError("expected ')'");
         return nullptr;
       }
-
-      if (currToken() == ')') {
+      // consume ')'
+      getNextToken();
+      frames.pop_back();
+      break;
+    case ExprFrame::call: {
+      if (tok == ',') {
+        // consume ','
+        getNextToken();
+        expectOperand = true;
         break;
       }
-
-      if (currToken() != ',') {
+      if (tok != ')') {
         logError("expected ')' or ',' in argument list");
         return nullptr;
       }
+      // consume ')'
+      getNextToken();
 
-      // consume ','
+      auto firstArg = operands.begin() + frame.firstOperand;
+      std::vector<ExprNode::UPtr> args(std::make_move_iterator(firstArg),
+                                       std::make_move_iterator(operands.end()));
+      operands.erase(firstArg, operands.end());
+      auto firstDepth = depths.begin() + frame.firstOperand;
+      unsigned childDepth =
+          firstDepth == depths.end()
+              ? 0
+              : *std::max_element(firstDepth, depths.end());
+      depths.erase(firstDepth, depths.end());
+      auto callExpr = std::make_unique<CallExprNode>(std::move(names.back()),
+                                                     std::move(args));
+      callExpr->setLoc(frame.loc);
+      if (!pushOperand(std::move(callExpr), childDepth)) {
+        return nullptr;
+      }
+      names.pop_back();
+      frames.pop_back();
+    } break;
+    case ExprFrame::index: {
+      if (tok != ']') {
+        logError("expected ']'");
+        return nullptr;
+      }
+      // consume ']'
       getNextToken();
+
+      if (currToken() == '=') {
+        // consume '='
+        getNextToken();
+        frame.kind = ExprFrame::store;
+        expectOperand = true;
+        break;
+      }
+      unsigned childDepth = 0;
+      auto index = popOperand(childDepth);
+      auto indexExpr = std::make_unique<IndexExprNode>(std::move(names.back()),
+                                                       std::move(index));
+      indexExpr->setLoc(frame.loc);
+      if (!pushOperand(std::move(indexExpr), childDepth)) {
+        return nullptr;
+      }
+      names.pop_back();
+      frames.pop_back();
+    } break;
+    case ExprFrame::store: {
+      unsigned childDepth = 0;
+      auto value = popOperand(childDepth);
+      auto index = popOperand(childDepth);
+      auto indexExpr = std::make_unique<IndexExprNode>(
+          std::move(names.back()), std::move(index), std::move(value));
+      indexExpr->setLoc(frame.loc);
+      if (!pushOperand(std::move(indexExpr), childDepth)) {
+        return nullptr;
+      }
+      names.pop_back();
+      frames.pop_back();
+    } break;
+    case ExprFrame::ifCond:
+      if (tok != Token::THEN) {
+        logError("expected 'then'");
+        return nullptr;
+      }
+      // consume 'then'
+      getNextToken();
+      frame.kind = ExprFrame::ifThen;
+      expectOperand = true;
+      break;
+    case ExprFrame::ifThen:
+      if (tok != Token::ELSE) {
+        logError("expected 'else'");
+        return nullptr;
+      }
+      // consume 'else'
+      getNextToken();
+      frame.kind = ExprFrame::ifElse;
+      expectOperand = true;
+      break;
+    case ExprFrame::ifElse: {
+      unsigned childDepth = 0;
+      auto elseExpr = popOperand(childDepth);
+      auto thenExpr = popOperand(childDepth);
+      auto condExpr = popOperand(childDepth);
+      auto ifelseExpr = std::make_unique<IfElseExprNode>(
+          std::move(condExpr), std::move(thenExpr), std::move(elseExpr));
+      ifelseExpr->setLoc(frame.loc);
+      if (!pushOperand(std::move(ifelseExpr), childDepth)) {
+        return nullptr;
+      }
+      frames.pop_back();
+    } break;
+    case ExprFrame::binOp:
+      assert(false && "operators are reduced");
+      return nullptr;
     }
   }
-
-  // consume ')'
-  getNextToken();
-
-  return std::make_unique<CallExprNode>(identStr, std::move(args));
 }
 
-ExprNode::UPtr Parser::parseIfElseExpr() {
-  // consume 'if'
-  getNextToken();
-
-  auto condExpr = parseExpr();
-  if (!condExpr) {
-    return nullptr;
-  }
-
-  if (currToken() != Token::THEN) {
-    logError("expected 'then'");
-    return nullptr;
-  }
-  // consume 'then'
-  getNextToken();
-
-  auto thenExpr = parseExpr();
-  if (!thenExpr) {
-    return nullptr;
-  }
+FunctionNode::UPtr Parser::parseFunction() {
+  bool isDecl = currToken() == Token::EXTERN;
+  SourceLocation loc = currLoc();
 
-  if (currToken() != Token::ELSE) {
-    logError("expected 'else'");
-    return nullptr;
-  }
-  // consume 'else'
+  // consume 'extern' or 'def'
   getNextToken();
 
-  auto elseExpr = parseExpr();
-  if (!elseExpr) {
-    return nullptr;
-  }
-
-  return std::make_unique<IfElseExprNode>(
-      std::move(condExpr), std::move(thenExpr), std::move(elseExpr));
-}
-
-ExprNode::UPtr Parser::parsePrimary() {
-  switch (currToken()) {
-  case NUMBER:
-    return parseNumberExpr();
-    break;
-  case IDENT:
-    return parseIdentExpr();
-    break;
-  case '(':
-    return parseParenExpr();
-    break;
-  case IF:
-    return parseIfElseExpr();
-    break;
-  default:
-    logError("unknown token while parsing expression");
-    return nullptr;
-    break;
-  }
-}
-
-ExprNode::UPtr Parser::parseBinOpRHS(int minPrec, ExprNode::UPtr lhs) {
-  while (true) {
-    int currPrec = getTokPrecedence();
-
-    if (currPrec < minPrec) {
-      return lhs;
-    }
-
-    int currBinOp = currToken();
-    // consume bin op
+  std::string funcName;
+  int op = 0;
+  int opPrec = 0;
+  if (currToken() == Token::IDENT) {
+    funcName = currIdentifier();
+    // consume IDENT
     getNextToken();
-
-    auto rhs = parsePrimary();
-    if (!rhs) {
+  } else if (currToken() == Token::BINARY) {
+    // consume 'binary'
+    op = getNextToken();
+    if (op < 0 || op >= kNumOpTokens) {
+      logError("expected operator character after 'binary'");
       return nullptr;
     }
+    funcName = std::string("binary") + char(op);
+    // consume operator
+    getNextToken();
 
-    int nextPrec = getTokPrecedence();
-    if (currPrec < nextPrec) {
-      rhs = parseBinOpRHS(currPrec + 1, std::move(rhs));
-      if (!rhs) {
+    opPrec = kDefaultUserOpPrecedence;
+    if (currToken() == Token::NUMBER) {
+      double prec = currNum();
+      if (prec < 1 || prec > kMaxPrecedence || prec != int(prec)) {
+        logError("expected operator precedence between 1 and 100");
         return nullptr;
       }
+      opPrec = prec;
+      // consume NUMBER
+      getNextToken();
     }
-
-    lhs = std::make_unique<BinaryExprNode>(currBinOp, std::move(lhs),
-                                           std::move(rhs));
-  }
-}
-
-ExprNode::UPtr Parser::parseExpr() {
-  auto lhs = parsePrimary();
-  if (!lhs) {
-    return nullptr;
-  }
-
-  return parseBinOpRHS(0, std::move(lhs));
-}
-
-FunctionNode::UPtr Parser::parseFunction() {
-  bool isDecl = currToken() == Token::EXTERN;
-
-  // consume 'extern' or 'def'
-  getNextToken();
-
-  if (currToken() != Token::IDENT) {
+  } else {
     logError("expected function name");
     return nullptr;
   }
 
-  std::string funcName = currIdentifier();
-  // consume IDENT
-  getNextToken();
-
   if (currToken() != '(') {
     logError("expected '(' in function declaration");
     return nullptr;
   }
 
+  // consume '('
+  getNextToken();
+
   std::vector<std::string> args;
-  while (getNextToken() == IDENT) {
+  std::vector<bool> bufferParams;
+  while (currToken() == IDENT) {
     args.push_back(currIdentifier());
+    // consume IDENT
+    bool isBuffer = getNextToken() == '[';
+    if (isBuffer) {
+      // consume '['
+      if (getNextToken() != ']') {
+        logError("expected ']' in buffer param");
+        return nullptr;
+      }
+      // consume ']'
+      getNextToken();
+    }
+    bufferParams.push_back(isBuffer);
   }
 
   if (currToken() != ')') {
@@ -256,6 +431,18 @@ FunctionNode::UPtr Parser::parseFunction() {
   // consume ')'
   getNextToken();
 
+  if (opPrec) {
+    if (args.size() != 2 || bufferParams[0] || bufferParams[1]) {
+      logError("binary operator must have two scalar operands");
+      return nullptr;
+    }
+    // Registered before parsing the body, which may use the operator
+    if (!addBinaryOp(op, opPrec)) {
+      logError("invalid binary operator character");
+      return nullptr;
+    }
+  }
+
   ExprNode::UPtr funcBody = nullptr;
   if (!isDecl) {
     // function def should have a body
@@ -264,21 +451,29 @@ FunctionNode::UPtr Parser::parseFunction() {
       return nullptr;
     }
   }
-  return std::make_unique<FunctionNode>(isDecl, funcName, std::move(args),
-                                        std::move(funcBody));
+  auto fun = std::make_unique<FunctionNode>(isDecl, funcName, std::move(args),
+                                            std::move(funcBody),
+                                            std::move(bufferParams));
+  fun->setLoc(loc);
+  fun->setSourceName(sourceName_);
+  fun->setPrecedence(opPrec);
+  return fun;
 }
 
 FunctionNode::UPtr Parser::parseLambdaExpr() {
+  SourceLocation loc = currLoc();
   if (auto expr = parseExpr()) {
-    return std::make_unique<FunctionNode>(false, "", std::vector<std::string>{},
-                                          std::move(expr));
+    auto fun = std::make_unique<FunctionNode>(
+        false, "", std::vector<std::string>{}, std::move(expr));
+    fun->setLoc(loc);
+    fun->setSourceName(sourceName_);
+    return fun;
   }
   return nullptr;
 }
 
 FunctionNode::UPtr Parser::handleFunction() {
   if (auto fun = parseFunction()) {
-    std::cerr << "Parsed a function" << std::endl;
     return std::move(fun);
   } else {
     // consume token for error recovery
@@ -289,7 +484,6 @@ FunctionNode::UPtr Parser::handleFunction() {
 
 FunctionNode::UPtr Parser::handleLambdaExpr() {
   if (auto fun = parseLambdaExpr()) {
-    std::cerr << "Parsed a lamba expression" << std::endl;
     return std::move(fun);
   } else {
     // consume token for error recovery
@@ -298,15 +492,16 @@ FunctionNode::UPtr Parser::handleLambdaExpr() {
   }
 }
 
-void Parser::parse() {
+void Parser::parse(Codegen &cg) {
   getNextToken();
-  Codegen cg;
   while (true) {
     std::cout << "kscope>";
     switch (currToken()) {
     case EOF_TOK:
+      cg.finalizeModule();
       std::cerr << "Printing module content:" << std::endl;
       cg.printModule();
+      cg.shutdown();
       return;
     case ';':
       getNextToken();
@@ -314,6 +509,7 @@ void Parser::parse() {
     case DEF: {
       auto fun = handleFunction();
       if (fun) {
+        std::cerr << "Parsed a function" << std::endl;
         fun->accept(cg);
         cg.printIR("Read function definition");
       }
@@ -321,6 +517,7 @@ void Parser::parse() {
     case EXTERN: {
       auto fun = handleFunction();
       if (fun) {
+        std::cerr << "Parsed a function" << std::endl;
         fun->accept(cg);
         cg.printIR("Read extern");
       }
@@ -328,10 +525,37 @@ void Parser::parse() {
     default: {
       auto fun = handleLambdaExpr();
       if (fun) {
+        std::cerr << "Parsed a lamba expression" << std::endl;
         fun->accept(cg);
         cg.printIR("Read lambda");
+        cg.evaluateTopLevelExpr();
       }
     } break;
     }
   }
 }
+
+std::vector<FunctionNode::UPtr> Parser::parseAll() {
+  std::vector<FunctionNode::UPtr> items;
+  getNextToken();
+  while (true) {
+    switch (currToken()) {
+    case EOF_TOK:
+      return items;
+    case ';':
+      getNextToken();
+      break;
+    case DEF:
+    case EXTERN:
+      if (auto fun = handleFunction()) {
+        items.push_back(std::move(fun));
+      }
+      break;
+    default:
+      if (auto fun = handleLambdaExpr()) {
+        items.push_back(std::move(fun));
+      }
+      break;
+    }
+  }
+}
@@ -1,20 +1,56 @@
 #ifndef PARSER_H
 #define PARSER_H
 
-#include <unordered_map>
+#include <string>
+#include <vector>
 
 #include "ast.h"
+#include "codegen.h"
 #include "lexer.h"
 
+// Binary operators are single ASCII characters
+constexpr int kNumOpTokens = 128;
+constexpr int kMaxPrecedence = 100;
+constexpr int kDefaultUserOpPrecedence = 30;
+
+// Precedence of the binary operators indexed by their token, 0 for the
+// tokens which are not binary operators. All operators are left
+// associative.
+struct PrecedenceTable {
+  int prec[kNumOpTokens];
+};
+
+constexpr PrecedenceTable builtinPrecedence() {
+  PrecedenceTable table{};
+  table.prec['+'] = 20;
+  table.prec['-'] = 20;
+  table.prec['*'] = 40;
+  table.prec['/'] = 40;
+  table.prec['%'] = 40;
+  return table;
+}
+
+constexpr PrecedenceTable kBuiltinPrecedence = builtinPrecedence();
+
 class Parser {
 public:
-  Parser(Lexer &lexer) : currToken_(Token::EOF_TOK), lexer_(lexer) {
-    initializeBinOpPrecedence();
-  }
-  void parse();
+  Parser(Lexer &lexer, std::string sourceName = "<stdin>",
+         const PrecedenceTable &precedence = kBuiltinPrecedence)
+      : currToken_(Token::EOF_TOK), lexer_(lexer),
+        sourceName_(std::move(sourceName)), precedence_(precedence) {}
+  // Read-eval-print loop: generate code for each top-level item as soon as
+  // it is parsed.
+  void parse(Codegen &cg);
+  // Parse the whole input into its top-level items without generating code
+  std::vector<FunctionNode::UPtr> parseAll();
+
+  bool hadError() const { return hadError_; }
+
+  // Parse `op` as a binary operator calling the function "binary<op>".
+  // Returns false if `op` cannot be a user defined operator.
+  bool addBinaryOp(int op, int prec);
 
 private:
-  void initializeBinOpPrecedence();
 
   int getNextToken() {
     currToken_ = lexer_.getToken();
@@ -27,14 +63,15 @@ private:
 
   std::string currIdentifier() const { return lexer_.identifierStr(); }
 
-  int getTokPrecedence();
+  SourceLocation currLoc() const { return lexer_.tokenLoc(); }
+
+  // Precedence of the binary operator `tok`, or 0
+  int tokPrecedence(int tok) const {
+    return tok >= 0 && tok < kNumOpTokens ? precedence_.prec[tok] : 0;
+  }
+
   void logError(const char *msg);
   ExprNode::UPtr parseNumberExpr();
-  ExprNode::UPtr parseParenExpr();
-  ExprNode::UPtr parseIdentExpr();
-  ExprNode::UPtr parseIfElseExpr();
-  ExprNode::UPtr parsePrimary();
-  ExprNode::UPtr parseBinOpRHS(int minPrec, ExprNode::UPtr lhs);
   ExprNode::UPtr parseExpr();
 
   FunctionNode::UPtr parseFunction();
@@ -45,7 +82,9 @@ private:
 
   int currToken_;
   Lexer &lexer_;
-  std::unordered_map<BinaryExprNode::Op, int> binOpPrecedence_;
+  std::string sourceName_;
+  bool hadError_ = false;
+  PrecedenceTable precedence_;
 };
 
 #endif // PARSER_H
@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "runtime.h"
+
+namespace {
+
+// Threads not started by the pool (e.g. the main thread) which may queue
+// tasks, the others run the tasks they spawn right away
+constexpr size_t kMaxExternalThreads = 16;
+
+// Tasks spawned by one thread
+class TaskQueue {
+public:
+  void push(KlcTask *task) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(task);
+    size_.store(tasks_.size(), std::memory_order_relaxed);
+  }
+
+  // Newest task, taken by the thread which spawned it
+  KlcTask *pop() {
+    if (!size()) {
+      return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (tasks_.empty()) {
+      return nullptr;
+    }
+    KlcTask *task = tasks_.back();
+    tasks_.pop_back();
+    size_.store(tasks_.size(), std::memory_order_relaxed);
+    return task;
+  }
+
+  // Oldest task, the largest one in divide and conquer code, taken by
+  // idle threads
+  KlcTask *steal() {
+    if (!size()) {
+      return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (tasks_.empty()) {
+      return nullptr;
+    }
+    KlcTask *task = tasks_.front();
+    tasks_.pop_front();
+    size_.store(tasks_.size(), std::memory_order_relaxed);
+    return task;
+  }
+
+  size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+private:
+  std::mutex mutex_;
+  std::deque<KlcTask *> tasks_;
+  std::atomic<size_t> size_{0};
+};
+
+class ThreadPool {
+public:
+  static ThreadPool &get() {
+    static ThreadPool pool;
+    return pool;
+  }
+
+  // Queue of the calling thread, nullptr if it has none
+  TaskQueue *queue() {
+    if (!threadRegistered) {
+      threadQueue = registerThread();
+      threadRegistered = true;
+    }
+    return threadQueue;
+  }
+
+  void push(TaskQueue &queue, KlcTask *task) {
+    ++queued_;
+    queue.push(task);
+    if (sleeping_) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      wake_.notify_one();
+    }
+  }
+
+  // Takes the newest task of `self`, or else steals the oldest task of
+  // another thread
+  KlcTask *take(TaskQueue &self) {
+    KlcTask *task = self.pop();
+    if (!task) {
+      size_t numQueues = numQueues_.load(std::memory_order_acquire);
+      size_t victim = nextVictim_.fetch_add(1, std::memory_order_relaxed);
+      for (size_t i = 0; !task && i < numQueues; ++i) {
+        task = queues_[(victim + i) % numQueues].steal();
+      }
+    }
+    if (task) {
+      --queued_;
+    }
+    return task;
+  }
+
+  // Checked for every call which may be spawned, so it avoids the thread
+  // local queue
+  bool needsTasks() const {
+    return queued_.load(std::memory_order_relaxed) < threads_.size();
+  }
+
+  static void run(KlcTask *task) {
+    task->run(task);
+    task->done.store(1, std::memory_order_release);
+  }
+
+private:
+  ThreadPool() {
+    unsigned numThreads = std::thread::hardware_concurrency();
+    if (const char *env = std::getenv("KLC_NUM_THREADS")) {
+      numThreads = std::strtoul(env, nullptr, 10);
+    }
+    numThreads = std::max(numThreads, 1u);
+
+    // The threads spawning tasks run tasks too while they wait
+    queues_.reset(new TaskQueue[numThreads - 1 + kMaxExternalThreads]);
+    numQueues_ = numThreads - 1;
+    for (unsigned i = 0; i < numThreads - 1; ++i) {
+      threads_.emplace_back([this, i]() { work(queues_[i]); });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread &thread : threads_) {
+      thread.join();
+    }
+  }
+
+  TaskQueue *registerThread() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (numQueues_ >= threads_.size() + kMaxExternalThreads) {
+      return nullptr;
+    }
+    return &queues_[numQueues_++];
+  }
+
+  void work(TaskQueue &self) {
+    threadQueue = &self;
+    threadRegistered = true;
+    while (true) {
+      if (KlcTask *task = take(self)) {
+        run(task);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      ++sleeping_;
+      wake_.wait(lock, [this]() { return stop_ || queued_ > 0; });
+      --sleeping_;
+      if (stop_) {
+        return;
+      }
+    }
+  }
+
+  std::unique_ptr<TaskQueue[]> queues_;
+  // Queues in use: one per pool thread, then the external threads
+  std::atomic<size_t> numQueues_{0};
+  std::vector<std::thread> threads_;
+  std::atomic<size_t> nextVictim_{0};
+
+  // Tasks waiting in the queues, and threads waiting for them
+  std::atomic<size_t> queued_{0};
+  std::atomic<unsigned> sleeping_{0};
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stop_ = false;
+
+  static thread_local TaskQueue *threadQueue;
+  static thread_local bool threadRegistered;
+};
+
+thread_local TaskQueue *ThreadPool::threadQueue = nullptr;
+thread_local bool ThreadPool::threadRegistered = false;
+
+} // namespace
+
+int32_t klc_should_spawn() { return ThreadPool::get().needsTasks(); }
+
+void klc_spawn(KlcTask *task) {
+  task->done.store(0, std::memory_order_relaxed);
+  ThreadPool &pool = ThreadPool::get();
+  TaskQueue *queue = pool.queue();
+  if (!queue) {
+    ThreadPool::run(task);
+    return;
+  }
+  pool.push(*queue, task);
+}
+
+void klc_join(KlcTask *task) {
+  ThreadPool &pool = ThreadPool::get();
+  TaskQueue *queue = pool.queue();
+  while (!task->done.load(std::memory_order_acquire)) {
+    // The task is the newest one of this thread unless it was stolen, help
+    // the thread which took it meanwhile
+    if (KlcTask *other = queue ? pool.take(*queue) : nullptr) {
+      ThreadPool::run(other);
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
@@ -0,0 +1,29 @@
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+#include <atomic>
+#include <cstdint>
+
+// Fork-join runtime of the code compiled with -fparallel-calls. Compiled
+// programs link libklcrt, the JIT resolves these functions against klc.
+
+// Header of the task frames codegen lays out on the stack of the spawning
+// function as { i8*, i64, args..., result }
+struct KlcTask {
+  // Reads the args from the frame, calls the function and stores the result
+  void (*run)(KlcTask *task);
+  std::atomic<int64_t> done;
+};
+
+extern "C" {
+// Returns nonzero while fewer tasks are queued than there are threads to
+// run them. Calls are made directly otherwise, which bounds the overhead of
+// fine grained recursion.
+int32_t klc_should_spawn();
+// Queues `task` on the calling thread, where idle threads steal it from
+void klc_spawn(KlcTask *task);
+// Returns once `task` has run, running it or other tasks meanwhile
+void klc_join(KlcTask *task);
+}
+
+#endif // RUNTIME_H
@@ -0,0 +1,569 @@
+#include <cstring>
+#include <unordered_map>
+
+#include "serialize.h"
+
+namespace {
+
+const char kMagic[4] = {'K', 'A', 'S', 'T'};
+const char kSnapshotMagic[4] = {'K', 'S', 'N', 'P'};
+constexpr size_t kSectionAlignment = 16;
+
+enum NodeTag : uint8_t {
+  numberTag,
+  variableTag,
+  binaryTag,
+  callTag,
+  ifElseTag,
+  functionTag,
+  indexTag,
+};
+
+void writeU8(std::string &out, uint8_t val) { out.push_back(char(val)); }
+
+void writeU32(std::string &out, uint32_t val) {
+  for (int i = 0; i < 4; ++i) {
+    out.push_back(char(val >> (8 * i)));
+  }
+}
+
+void writeU64(std::string &out, uint64_t val) {
+  for (int i = 0; i < 8; ++i) {
+    out.push_back(char(val >> (8 * i)));
+  }
+}
+
+void writeLengthPrefixed(std::string &out, const std::string &str) {
+  writeU32(out, str.size());
+  out += str;
+}
+
+void writeSection(std::string &out, const char *data, size_t size) {
+  writeU64(out, size);
+  out.resize((out.size() + kSectionAlignment - 1) / kSectionAlignment *
+             kSectionAlignment);
+  out.append(data, size);
+}
+
+class AstWriter : public Visitor {
+public:
+  void visit(ExprNode &exprNode) override { assert(false); }
+
+  void visit(NumberExprNode &numExpr) override {
+    writeTag(numberTag, numExpr);
+    double num = numExpr.num();
+    uint64_t bits;
+    memcpy(&bits, &num, sizeof(bits));
+    writeU64(nodes_, bits);
+  }
+
+  void visit(VariableExprNode &varExpr) override {
+    writeTag(variableTag, varExpr);
+    writeString(varExpr.varName());
+  }
+
+  void visit(BinaryExprNode &binExpr) override {
+    // Preorder, as if recursing into each lhs
+    auto chain = lhsChain(binExpr);
+    for (BinaryExprNode *node : chain) {
+      writeTag(binaryTag, *node);
+      writeU8(nodes_, node->opChar());
+    }
+    chain.back()->lhs()->accept(*this);
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+      (*it)->rhs()->accept(*this);
+    }
+  }
+
+  void visit(CallExprNode &callExpr) override {
+    writeTag(callTag, callExpr);
+    writeString(callExpr.callee());
+    writeU32(nodes_, callExpr.args().size());
+    for (const auto &arg : callExpr.args()) {
+      arg->accept(*this);
+    }
+  }
+
+  void visit(IfElseExprNode &ifelseExpr) override {
+    writeTag(ifElseTag, ifelseExpr);
+    ifelseExpr.condExpr()->accept(*this);
+    ifelseExpr.thenExpr()->accept(*this);
+    ifelseExpr.elseExpr()->accept(*this);
+  }
+
+  void visit(IndexExprNode &indexExpr) override {
+    writeTag(indexTag, indexExpr);
+    writeString(indexExpr.buffer());
+    writeU8(nodes_, indexExpr.value() != nullptr);
+    indexExpr.index()->accept(*this);
+    if (indexExpr.value()) {
+      indexExpr.value()->accept(*this);
+    }
+  }
+
+  void visit(FunctionNode &funcNode) override {
+    writeTag(functionTag, funcNode);
+    writeU8(nodes_, funcNode.isDecl());
+    writeString(funcNode.name());
+    writeU32(nodes_, funcNode.args().size());
+    for (size_t i = 0; i < funcNode.args().size(); ++i) {
+      writeString(funcNode.args()[i]);
+      writeU8(nodes_, funcNode.isBufferParam(i));
+    }
+    writeU8(nodes_, funcNode.precedence());
+    writeU8(nodes_, funcNode.body() != nullptr);
+    if (funcNode.body()) {
+      funcNode.body()->accept(*this);
+    }
+  }
+
+  std::string finish(uint64_t sourceHash, uint32_t numItems) {
+    std::string out(kMagic, sizeof(kMagic));
+    writeU32(out, kAstFormatVersion);
+    writeU64(out, sourceHash);
+    writeU32(out, strings_.size());
+    for (const auto &str : strings_) {
+      writeLengthPrefixed(out, str);
+    }
+    writeU32(out, numItems);
+    out += nodes_;
+    return out;
+  }
+
+private:
+  void writeTag(NodeTag tag, const BaseNode &node) {
+    writeU8(nodes_, tag);
+    writeU32(nodes_, node.loc().line);
+    writeU32(nodes_, node.loc().col);
+  }
+
+  void writeString(const std::string &str) {
+    auto it = stringIds_.find(str);
+    if (it == stringIds_.end()) {
+      it = stringIds_.emplace(str, strings_.size()).first;
+      strings_.push_back(str);
+    }
+    writeU32(nodes_, it->second);
+  }
+
+  std::string nodes_;
+  std::vector<std::string> strings_;
+  std::unordered_map<std::string, uint32_t> stringIds_;
+};
+
+// Every read is bounds checked, so a truncated or corrupted file is
+// rejected rather than trusted.
+class ByteReader {
+public:
+  ByteReader(const char *data, size_t size) : pos_(data), end_(data + size) {}
+
+  bool atEnd() const { return pos_ == end_; }
+
+  bool readU8(uint8_t &val) {
+    if (!has(1)) {
+      return false;
+    }
+    val = uint8_t(*pos_++);
+    return true;
+  }
+
+  bool readU32(uint32_t &val) {
+    if (!has(4)) {
+      return false;
+    }
+    val = 0;
+    for (int i = 0; i < 4; ++i) {
+      val |= uint32_t(uint8_t(*pos_++)) << (8 * i);
+    }
+    return true;
+  }
+
+  bool readU64(uint64_t &val) {
+    if (!has(8)) {
+      return false;
+    }
+    val = 0;
+    for (int i = 0; i < 8; ++i) {
+      val |= uint64_t(uint8_t(*pos_++)) << (8 * i);
+    }
+    return true;
+  }
+
+  // Points `bytes` at the next `size` bytes
+  bool readBytes(const char *&bytes, size_t size) {
+    if (!has(size)) {
+      return false;
+    }
+    bytes = pos_;
+    pos_ += size;
+    return true;
+  }
+
+  bool readLengthPrefixed(std::string &str) {
+    uint32_t len;
+    const char *bytes;
+    if (!readU32(len) || !readBytes(bytes, len)) {
+      return false;
+    }
+    str.assign(bytes, len);
+    return true;
+  }
+
+  // Reads a section written by writeSection(), relative to `start`
+  bool readSection(const char *start, const char *&data, size_t &size) {
+    uint64_t size64;
+    if (!readU64(size64)) {
+      return false;
+    }
+    size_t padding = (kSectionAlignment - size_t(pos_ - start) %
+                                              kSectionAlignment) %
+                     kSectionAlignment;
+    const char *bytes;
+    if (!readBytes(bytes, padding) || !readBytes(data, size64)) {
+      return false;
+    }
+    size = size64;
+    return true;
+  }
+
+protected:
+  bool has(size_t n) const { return size_t(end_ - pos_) >= n; }
+
+  const char *pos_;
+  const char *end_;
+};
+
+// Reads nodes back
+class AstReader : public ByteReader {
+public:
+  AstReader(const char *data, size_t size) : ByteReader(data, size) {}
+
+  bool readHeader(uint64_t sourceHash) {
+    if (!has(sizeof(kMagic)) || memcmp(pos_, kMagic, sizeof(kMagic)) != 0) {
+      return false;
+    }
+    pos_ += sizeof(kMagic);
+    uint32_t version;
+    uint64_t hash;
+    if (!readU32(version) || version != kAstFormatVersion || !readU64(hash) ||
+        hash != sourceHash) {
+      return false;
+    }
+
+    uint32_t numStrings;
+    if (!readU32(numStrings)) {
+      return false;
+    }
+    for (uint32_t i = 0; i < numStrings; ++i) {
+      uint32_t len;
+      if (!readU32(len) || !has(len)) {
+        return false;
+      }
+      strings_.emplace_back(pos_, len);
+      pos_ += len;
+    }
+    return true;
+  }
+
+  bool readItems(std::vector<FunctionNode::UPtr> &items) {
+    uint32_t numItems;
+    if (!readU32(numItems)) {
+      return false;
+    }
+    for (uint32_t i = 0; i < numItems; ++i) {
+      uint8_t tag;
+      SourceLocation loc;
+      if (!readU8(tag) || tag != functionTag || !readLoc(loc)) {
+        return false;
+      }
+      auto fun = readFunction();
+      if (!fun) {
+        return false;
+      }
+      fun->setLoc(loc);
+      items.push_back(std::move(fun));
+    }
+    return atEnd();
+  }
+
+private:
+  bool readLoc(SourceLocation &loc) {
+    return readU32(loc.line) && readU32(loc.col);
+  }
+
+  bool readString(std::string &str) {
+    uint32_t id;
+    if (!readU32(id) || id >= strings_.size()) {
+      return false;
+    }
+    str = strings_[id];
+    return true;
+  }
+
+  ExprNode::UPtr readExpr() {
+    uint8_t tag;
+    SourceLocation loc;
+    // The parser builds no deeper tree, a file with one is malformed
+    if (depth_ >= kMaxExprDepth || !readU8(tag) || !readLoc(loc)) {
+      return nullptr;
+    }
+    ++depth_;
+    ExprNode::UPtr expr = readExprFields(tag);
+    --depth_;
+    if (expr) {
+      expr->setLoc(loc);
+    }
+    return expr;
+  }
+
+  ExprNode::UPtr readExprFields(uint8_t tag) {
+    switch (tag) {
+    case numberTag: {
+      uint64_t bits;
+      if (!readU64(bits)) {
+        return nullptr;
+      }
+      double num;
+      memcpy(&num, &bits, sizeof(num));
+      return std::make_unique<NumberExprNode>(num);
+    }
+    case variableTag: {
+      std::string name;
+      if (!readString(name)) {
+        return nullptr;
+      }
+      return std::make_unique<VariableExprNode>(std::move(name));
+    }
+    case binaryTag: {
+      // Read the chain of operators down the lhs in a loop, see lhsChain().
+      // The outermost one gets its location from readExpr().
+      std::vector<std::pair<uint8_t, SourceLocation>> chain(1);
+      if (!readU8(chain[0].first)) {
+        return nullptr;
+      }
+      while (has(1) && uint8_t(*pos_) == binaryTag) {
+        ++pos_;
+        chain.emplace_back();
+        if (!readLoc(chain.back().second) || !readU8(chain.back().first)) {
+          return nullptr;
+        }
+      }
+      auto lhs = readExpr();
+      if (!lhs) {
+        return nullptr;
+      }
+      for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+        auto rhs = readExpr();
+        if (!rhs) {
+          return nullptr;
+        }
+        lhs = std::make_unique<BinaryExprNode>(it->first, std::move(lhs),
+                                               std::move(rhs));
+        lhs->setLoc(it->second);
+      }
+      return lhs;
+    }
+    case callTag: {
+      std::string callee;
+      uint32_t numArgs;
+      if (!readString(callee) || !readU32(numArgs)) {
+        return nullptr;
+      }
+      std::vector<ExprNode::UPtr> args;
+      for (uint32_t i = 0; i < numArgs; ++i) {
+        auto arg = readExpr();
+        if (!arg) {
+          return nullptr;
+        }
+        args.push_back(std::move(arg));
+      }
+      return std::make_unique<CallExprNode>(std::move(callee),
+                                            std::move(args));
+    }
+    case ifElseTag: {
+      auto condExpr = readExpr();
+      auto thenExpr = condExpr ? readExpr() : nullptr;
+      auto elseExpr = thenExpr ? readExpr() : nullptr;
+      if (!elseExpr) {
+        return nullptr;
+      }
+      return std::make_unique<IfElseExprNode>(
+          std::move(condExpr), std::move(thenExpr), std::move(elseExpr));
+    }
+    case indexTag: {
+      std::string buffer;
+      uint8_t hasValue;
+      if (!readString(buffer) || !readU8(hasValue)) {
+        return nullptr;
+      }
+      auto index = readExpr();
+      if (!index) {
+        return nullptr;
+      }
+      ExprNode::UPtr value;
+      if (hasValue) {
+        value = readExpr();
+        if (!value) {
+          return nullptr;
+        }
+      }
+      return std::make_unique<IndexExprNode>(
+          std::move(buffer), std::move(index), std::move(value));
+    }
+    default:
+      return nullptr;
+    }
+  }
+
+  FunctionNode::UPtr readFunction() {
+    uint8_t isDecl;
+    std::string name;
+    uint32_t numArgs;
+    if (!readU8(isDecl) || !readString(name) || !readU32(numArgs)) {
+      return nullptr;
+    }
+    // Grown as the args are read, the count comes from the file
+    std::vector<std::string> args;
+    std::vector<bool> bufferParams;
+    for (uint32_t i = 0; i < numArgs; ++i) {
+      std::string arg;
+      uint8_t isBuffer;
+      if (!readString(arg) || !readU8(isBuffer)) {
+        return nullptr;
+      }
+      args.push_back(std::move(arg));
+      bufferParams.push_back(isBuffer);
+    }
+
+    uint8_t precedence, hasBody;
+    if (!readU8(precedence) || !readU8(hasBody)) {
+      return nullptr;
+    }
+    ExprNode::UPtr body;
+    if (hasBody) {
+      body = readExpr();
+      if (!body) {
+        return nullptr;
+      }
+    }
+    auto fun = std::make_unique<FunctionNode>(isDecl, std::move(name),
+                                              std::move(args), std::move(body),
+                                              std::move(bufferParams));
+    fun->setPrecedence(precedence);
+    return fun;
+  }
+
+  std::vector<std::string> strings_;
+  // Nesting of the expression being read
+  unsigned depth_ = 0;
+};
+
+} // namespace
+
+uint64_t hashSource(const std::string &source) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (char c : source) {
+    hash = (hash ^ uint8_t(c)) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+std::string serializeAst(const std::vector<FunctionNode::UPtr> &items,
+                         uint64_t sourceHash) {
+  AstWriter writer;
+  for (const auto &item : items) {
+    item->accept(writer);
+  }
+  return writer.finish(sourceHash, items.size());
+}
+
+bool deserializeAst(const char *data, size_t size, uint64_t sourceHash,
+                    std::vector<FunctionNode::UPtr> &items) {
+  AstReader reader(data, size);
+  std::vector<FunctionNode::UPtr> readItems;
+  if (!reader.readHeader(sourceHash) || !reader.readItems(readItems)) {
+    return false;
+  }
+  items = std::move(readItems);
+  return true;
+}
+
+std::string serializeSnapshot(const Snapshot &snapshot) {
+  std::string out(kSnapshotMagic, sizeof(kSnapshotMagic));
+  writeU32(out, kSnapshotFormatVersion);
+  writeLengthPrefixed(out, snapshot.target);
+
+  writeU32(out, snapshot.functions.size());
+  for (const auto &fn : snapshot.functions) {
+    writeLengthPrefixed(out, fn.name);
+    writeU32(out, fn.bufferParams.size());
+    for (bool isBuffer : fn.bufferParams) {
+      writeU8(out, isBuffer);
+    }
+    writeU8(out, fn.flags);
+    writeU32(out, fn.taskCost);
+  }
+
+  writeU32(out, snapshot.binaryOps.size());
+  for (const auto &op : snapshot.binaryOps) {
+    writeU8(out, op.first);
+    writeU8(out, op.second);
+  }
+
+  writeSection(out, snapshot.bitcode, snapshot.bitcodeSize);
+  writeSection(out, snapshot.object, snapshot.objectSize);
+  return out;
+}
+
+bool deserializeSnapshot(const char *data, size_t size, Snapshot &snapshot) {
+  ByteReader reader(data, size);
+  const char *magic;
+  uint32_t version;
+  if (!reader.readBytes(magic, sizeof(kSnapshotMagic)) ||
+      memcmp(magic, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0 ||
+      !reader.readU32(version) || version != kSnapshotFormatVersion ||
+      !reader.readLengthPrefixed(snapshot.target)) {
+    return false;
+  }
+
+  uint32_t numFunctions;
+  if (!reader.readU32(numFunctions)) {
+    return false;
+  }
+  snapshot.functions.clear();
+  for (uint32_t i = 0; i < numFunctions; ++i) {
+    SnapshotFunction fn;
+    uint32_t numParams;
+    if (!reader.readLengthPrefixed(fn.name) || !reader.readU32(numParams)) {
+      return false;
+    }
+    for (uint32_t j = 0; j < numParams; ++j) {
+      uint8_t isBuffer;
+      if (!reader.readU8(isBuffer)) {
+        return false;
+      }
+      fn.bufferParams.push_back(isBuffer);
+    }
+    if (!reader.readU8(fn.flags) || !reader.readU32(fn.taskCost)) {
+      return false;
+    }
+    snapshot.functions.push_back(std::move(fn));
+  }
+
+  uint32_t numOps;
+  if (!reader.readU32(numOps)) {
+    return false;
+  }
+  snapshot.binaryOps.clear();
+  for (uint32_t i = 0; i < numOps; ++i) {
+    uint8_t op, precedence;
+    if (!reader.readU8(op) || !reader.readU8(precedence)) {
+      return false;
+    }
+    snapshot.binaryOps.emplace_back(op, precedence);
+  }
+
+  return reader.readSection(data, snapshot.bitcode, snapshot.bitcodeSize) &&
+         reader.readSection(data, snapshot.object, snapshot.objectSize) &&
+         reader.atEnd();
+}
@@ -0,0 +1,78 @@
+#ifndef SERIALIZE_H
+#define SERIALIZE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ast.h"
+
+// Binary AST format, all integers little endian:
+//   header:  "KAST" u32:version u64:source-hash
+//   strings: u32:count (u32:length bytes)*
+//   items:   u32:count node*
+// Nodes are written in preorder as a u8 tag, their source location
+// (u32:line u32:col) and their fields; identifiers are indexes into the
+// string table.
+constexpr uint32_t kAstFormatVersion = 5;
+
+// FNV-1a hash of a source file's content, used as the cache key
+uint64_t hashSource(const std::string &source);
+
+std::string serializeAst(const std::vector<FunctionNode::UPtr> &items,
+                         uint64_t sourceHash);
+
+// Rebuild the items from a serialized AST. Returns false if the data is
+// malformed, was written by another format version, or for another source.
+bool deserializeAst(const char *data, size_t size, uint64_t sourceHash,
+                    std::vector<FunctionNode::UPtr> &items);
+
+// Prelude snapshot format, all integers little endian:
+//   header:    "KSNP" u32:version u32:length target
+//   functions: u32:count (u32:length name u32:param-count u8:is-buffer*
+//              u8:flags u32:task-cost)*
+//   operators: u32:count (u8:op u8:precedence)*
+//   bitcode:   u64:size, zeros up to a 16 byte offset, bytes
+//   object:    u64:size, zeros up to a 16 byte offset, bytes
+// The sections are aligned so that they can be used in place in a mapped
+// file.
+constexpr uint32_t kSnapshotFormatVersion = 3;
+
+// A function declared or defined by a prelude
+struct SnapshotFunction {
+  enum Flags : uint8_t {
+    defined = 1,
+    // Has an integer version (see IntegerInference)
+    integerVersion = 2,
+    // Calls may run as tasks (see TaskInfo)
+    pure = 4,
+  };
+
+  std::string name;
+  std::vector<bool> bufferParams;
+  uint8_t flags = 0;
+  uint32_t taskCost = 1;
+};
+
+struct Snapshot {
+  // Target triple and CPU the object was compiled for
+  std::string target;
+  std::vector<SnapshotFunction> functions;
+  // Binary operators and their precedences
+  std::vector<std::pair<char, int>> binaryOps;
+  // Point into the serialized data once deserialized
+  const char *bitcode = nullptr;
+  size_t bitcodeSize = 0;
+  const char *object = nullptr;
+  size_t objectSize = 0;
+};
+
+std::string serializeSnapshot(const Snapshot &snapshot);
+
+// Returns false if the data is malformed or was written by another format
+// version. The bitcode and object of `snapshot` point into `data`.
+bool deserializeSnapshot(const char *data, size_t size, Snapshot &snapshot);
+
+#endif // SERIALIZE_H
@@ -0,0 +1,205 @@
+#include "specialize.h"
+#include <algorithm>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <map>
+#include <utility>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+// Specializing a clone may expose new constant calls (e.g. recursive calls
+// with a folded argument), bound how many times we go over the module.
+constexpr unsigned kMaxRounds = 4;
+
+// Clones that folded down to at most this many instructions and call
+// nothing are inlined into their callers.
+constexpr unsigned kInlineThreshold = 16;
+
+// A callee together with its constant arguments: (arg index, value bits)
+using SpecKey =
+    std::pair<Function *, std::vector<std::pair<unsigned, uint64_t>>>;
+
+struct CallSites {
+  std::vector<CallInst *> calls;
+  // Number of times the call sites are expected to run, derived from the
+  // entry counts of their callers when a profile is available.
+  uint64_t weight = 0;
+};
+
+bool isSpecializable(const Function *callee) {
+  return callee && !callee->isDeclaration() && !callee->isVarArg() &&
+         !callee->getName().startswith("__klc_");
+}
+
+// Double args, and the i64 args of integer versions
+bool isConstantArg(const Value *arg) {
+  return isa<ConstantFP>(arg) || isa<ConstantInt>(arg);
+}
+
+SpecKey getSpecKey(CallInst *call) {
+  SpecKey key{call->getCalledFunction(), {}};
+  for (unsigned i = 0; i < call->arg_size(); ++i) {
+    if (auto *constArg = dyn_cast<ConstantFP>(call->getArgOperand(i))) {
+      key.second.emplace_back(
+          i, constArg->getValueAPF().bitcastToAPInt().getZExtValue());
+    } else if (auto *intArg = dyn_cast<ConstantInt>(call->getArgOperand(i))) {
+      key.second.emplace_back(i, intArg->getZExtValue());
+    }
+  }
+  return key;
+}
+
+Function *cloneForKey(const SpecKey &key) {
+  Function *callee = key.first;
+  ValueToValueMapTy vmap;
+  for (const auto &constArg : key.second) {
+    Argument *arg = callee->getArg(constArg.first);
+    if (arg->getType()->isIntegerTy()) {
+      vmap[arg] = ConstantInt::get(arg->getType(), constArg.second);
+    } else {
+      vmap[arg] = ConstantFP::get(
+          arg->getType(), APInt(64, constArg.second).bitsToDouble());
+    }
+  }
+
+  // Arguments present in vmap are dropped from the clone's signature
+  Function *spec = CloneFunction(callee, vmap);
+  spec->setName(callee->getName() + ".spec");
+  spec->setLinkage(GlobalValue::InternalLinkage);
+  return spec;
+}
+
+bool isInlinable(const Function *spec) {
+  if (spec->getInstructionCount() > kInlineThreshold) {
+    return false;
+  }
+  for (const BasicBlock &bb : *spec) {
+    for (const Instruction &inst : bb) {
+      if (isa<CallInst>(inst)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Inline the small leaf clones, latest first: a chain of clones created for
+// a recursive function then collapses into straight-line code.
+void inlineLeafSpecs(const std::vector<Function *> &created,
+                     legacy::FunctionPassManager &fpm) {
+  for (auto it = created.rbegin(); it != created.rend(); ++it) {
+    Function *spec = *it;
+    if (!isInlinable(spec)) {
+      continue;
+    }
+    std::vector<CallInst *> calls;
+    for (User *user : spec->users()) {
+      if (auto *call = dyn_cast<CallInst>(user)) {
+        calls.push_back(call);
+      }
+    }
+    for (CallInst *call : calls) {
+      Function *caller = call->getFunction();
+      InlineFunctionInfo info;
+      if (InlineFunction(*call, info).isSuccess()) {
+        fpm.run(*caller);
+      }
+    }
+  }
+}
+
+void redirectCall(CallInst *call, Function *spec) {
+  std::vector<Value *> args;
+  for (unsigned i = 0; i < call->arg_size(); ++i) {
+    if (!isConstantArg(call->getArgOperand(i))) {
+      args.push_back(call->getArgOperand(i));
+    }
+  }
+  CallInst *specCall = CallInst::Create(spec, args, "", call);
+  specCall->takeName(call);
+  call->replaceAllUsesWith(specCall);
+  call->eraseFromParent();
+}
+
+} // namespace
+
+unsigned specializeConstantCalls(Module &module,
+                                 legacy::FunctionPassManager &fpm,
+                                 unsigned budget) {
+  std::map<SpecKey, Function *> specs;
+  std::vector<Function *> created;
+
+  for (unsigned round = 0; round < kMaxRounds; ++round) {
+    // Group the calls passing constant arguments by callee and constants,
+    // remembering the order keys are first seen in for stable output.
+    std::map<SpecKey, CallSites> callSites;
+    std::vector<SpecKey> keys;
+    for (Function &fun : module) {
+      uint64_t weight = 1;
+      if (auto entryCount = fun.getEntryCount()) {
+        weight = entryCount->getCount();
+      }
+      for (BasicBlock &bb : fun) {
+        for (Instruction &inst : bb) {
+          auto *call = dyn_cast<CallInst>(&inst);
+          if (!call || !isSpecializable(call->getCalledFunction())) {
+            continue;
+          }
+          SpecKey key = getSpecKey(call);
+          if (key.second.empty()) {
+            continue;
+          }
+          auto it = callSites.find(key);
+          if (it == callSites.end()) {
+            it = callSites.emplace(key, CallSites()).first;
+            keys.push_back(key);
+          }
+          it->second.calls.push_back(call);
+          it->second.weight += weight;
+        }
+      }
+    }
+
+    // Spend the budget on the most frequently executed tuples first
+    std::stable_sort(keys.begin(), keys.end(),
+                     [&](const SpecKey &lhs, const SpecKey &rhs) {
+                       return callSites[lhs].weight > callSites[rhs].weight;
+                     });
+
+    bool changed = false;
+    for (const SpecKey &key : keys) {
+      Function *&spec = specs[key];
+      if (!spec) {
+        if (key.first->getInstructionCount() > budget) {
+          continue;
+        }
+        spec = cloneForKey(key);
+        fpm.run(*spec);
+        budget -= std::min(budget, spec->getInstructionCount());
+        created.push_back(spec);
+      }
+      for (CallInst *call : callSites[key].calls) {
+        redirectCall(call, spec);
+      }
+      changed = true;
+    }
+
+    if (!changed) {
+      break;
+    }
+  }
+
+  inlineLeafSpecs(created, fpm);
+
+  // Inlining and later rounds may have left clones unreachable
+  for (Function *spec : created) {
+    if (spec->use_empty()) {
+      spec->eraseFromParent();
+    }
+  }
+  return created.size();
+}
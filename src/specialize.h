@@ -0,0 +1,16 @@
+#ifndef SPECIALIZE_H
+#define SPECIALIZE_H
+
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/Module.h>
+
+// Clone functions for the constant argument tuples they are called with,
+// substitute the constants into the clones, optimize them with fpm and
+// redirect the matching call sites to the clones. The most frequently seen
+// tuples are specialized first, until `budget` instructions have been added
+// to the module. Returns the number of clones created.
+unsigned specializeConstantCalls(llvm::Module &module,
+                                 llvm::legacy::FunctionPassManager &fpm,
+                                 unsigned budget);
+
+#endif // SPECIALIZE_H
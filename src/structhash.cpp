@@ -0,0 +1,267 @@
+#include <cstring>
+#include <typeinfo>
+
+#include "structhash.h"
+
+namespace {
+
+enum NodeTag : uint64_t {
+  numberTag = 1,
+  variableTag,
+  paramTag,
+  binaryTag,
+  callTag,
+  ifElseTag,
+  indexTag,
+};
+
+uint64_t hashCombine(uint64_t hash, uint64_t val) {
+  return hash ^ (val + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2));
+}
+
+uint64_t hashString(const std::string &str) {
+  return std::hash<std::string>()(str);
+}
+
+uint64_t numberBits(double num) {
+  uint64_t bits;
+  memcpy(&bits, &num, sizeof(bits));
+  return bits;
+}
+
+// Writes the canonical form of a function body, see canonicalForm()
+class CanonicalWriter : public Visitor {
+public:
+  explicit CanonicalWriter(const std::vector<std::string> &params) {
+    for (unsigned i = 0; i < params.size(); ++i) {
+      paramIndex_[params[i]] = i;
+    }
+  }
+
+  std::string &str() { return str_; }
+
+  void visit(ExprNode &exprNode) override { assert(false); }
+
+  void visit(NumberExprNode &numExpr) override {
+    str_ += 'n';
+    str_ += std::to_string(numberBits(numExpr.num()));
+  }
+
+  void visit(VariableExprNode &varExpr) override {
+    writeVariable(varExpr.varName());
+  }
+
+  void visit(BinaryExprNode &binExpr) override {
+    // Preorder, as if recursing into each lhs
+    auto chain = lhsChain(binExpr);
+    for (BinaryExprNode *node : chain) {
+      str_ += 'b';
+      str_ += node->opChar();
+    }
+    chain.back()->lhs()->accept(*this);
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+      (*it)->rhs()->accept(*this);
+    }
+  }
+
+  void visit(CallExprNode &callExpr) override {
+    str_ += 'c';
+    str_ += callExpr.callee();
+    str_ += ' ';
+    str_ += std::to_string(callExpr.args().size());
+    for (const auto &arg : callExpr.args()) {
+      arg->accept(*this);
+    }
+  }
+
+  void visit(IfElseExprNode &ifelseExpr) override {
+    str_ += 'i';
+    ifelseExpr.condExpr()->accept(*this);
+    ifelseExpr.thenExpr()->accept(*this);
+    ifelseExpr.elseExpr()->accept(*this);
+  }
+
+  void visit(IndexExprNode &indexExpr) override {
+    str_ += indexExpr.value() ? 's' : 'x';
+    writeVariable(indexExpr.buffer());
+    indexExpr.index()->accept(*this);
+    if (indexExpr.value()) {
+      indexExpr.value()->accept(*this);
+    }
+  }
+
+  void visit(FunctionNode &funcNode) override {
+    str_ += 'f';
+    str_ += std::to_string(funcNode.args().size());
+    for (bool isBuffer : funcNode.bufferParams()) {
+      str_ += isBuffer ? 'b' : 's';
+    }
+    if (funcNode.body()) {
+      funcNode.body()->accept(*this);
+    }
+  }
+
+private:
+  void writeVariable(const std::string &name) {
+    auto it = paramIndex_.find(name);
+    if (it != paramIndex_.end()) {
+      str_ += '$';
+      str_ += std::to_string(it->second);
+    } else {
+      str_ += 'v';
+      str_ += name;
+    }
+    str_ += ' ';
+  }
+
+  std::unordered_map<std::string, unsigned> paramIndex_;
+  std::string str_;
+};
+
+} // namespace
+
+StructuralHasher::StructuralHasher(const std::vector<std::string> &params) {
+  for (unsigned i = 0; i < params.size(); ++i) {
+    paramIndex_[params[i]] = i;
+  }
+}
+
+const StructuralHasher::Info &StructuralHasher::hashChild(ExprNode &expr) {
+  expr.accept(*this);
+  return infos_.at(&expr);
+}
+
+void StructuralHasher::visit(ExprNode &exprNode) { assert(false); }
+
+void StructuralHasher::visit(NumberExprNode &numExpr) {
+  infos_[&numExpr] = {hashCombine(numberTag, numberBits(numExpr.num())),
+                      true};
+}
+
+void StructuralHasher::visit(VariableExprNode &varExpr) {
+  auto it = paramIndex_.find(varExpr.varName());
+  uint64_t hash = it != paramIndex_.end()
+                      ? hashCombine(paramTag, it->second)
+                      : hashCombine(variableTag, hashString(varExpr.varName()));
+  infos_[&varExpr] = {hash, true};
+}
+
+void StructuralHasher::visit(BinaryExprNode &binExpr) {
+  auto chain = lhsChain(binExpr);
+  Info lhs = hashChild(*chain.back()->lhs());
+  for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+    BinaryExprNode &node = **it;
+    Info rhs = hashChild(*node.rhs());
+    uint64_t hash = hashCombine(binaryTag, node.opChar());
+    hash = hashCombine(hashCombine(hash, lhs.hash), rhs.hash);
+    // User defined operators are calls
+    lhs = {hash, lhs.pure && rhs.pure &&
+                     node.op() != BinaryExprNode::Op::custom};
+    infos_[&node] = lhs;
+  }
+}
+
+void StructuralHasher::visit(CallExprNode &callExpr) {
+  uint64_t hash = hashCombine(callTag, hashString(callExpr.callee()));
+  for (const auto &arg : callExpr.args()) {
+    hash = hashCombine(hash, hashChild(*arg).hash);
+  }
+  infos_[&callExpr] = {hash, false};
+}
+
+void StructuralHasher::visit(IfElseExprNode &ifelseExpr) {
+  Info condInfo = hashChild(*ifelseExpr.condExpr());
+  Info thenInfo = hashChild(*ifelseExpr.thenExpr());
+  Info elseInfo = hashChild(*ifelseExpr.elseExpr());
+  uint64_t hash = hashCombine(ifElseTag, condInfo.hash);
+  hash = hashCombine(hashCombine(hash, thenInfo.hash), elseInfo.hash);
+  infos_[&ifelseExpr] = {hash,
+                         condInfo.pure && thenInfo.pure && elseInfo.pure};
+}
+
+void StructuralHasher::visit(IndexExprNode &indexExpr) {
+  auto it = paramIndex_.find(indexExpr.buffer());
+  uint64_t hash = hashCombine(indexTag, it != paramIndex_.end()
+                                            ? it->second
+                                            : hashString(indexExpr.buffer()));
+  hash = hashCombine(hash, hashChild(*indexExpr.index()).hash);
+  if (indexExpr.value()) {
+    hash = hashCombine(hash, hashChild(*indexExpr.value()).hash);
+  }
+  // Buffer elements may be assigned between two reads
+  infos_[&indexExpr] = {hash, false};
+}
+
+void StructuralHasher::visit(FunctionNode &funcNode) {
+  if (funcNode.body()) {
+    funcNode.body()->accept(*this);
+  }
+}
+
+bool structurallyEqual(const ExprNode &lhs, const ExprNode &rhs) {
+  if (typeid(lhs) != typeid(rhs)) {
+    return false;
+  }
+
+  if (auto *num = dynamic_cast<const NumberExprNode *>(&lhs)) {
+    return numberBits(num->num()) ==
+           numberBits(static_cast<const NumberExprNode &>(rhs).num());
+  }
+  if (auto *var = dynamic_cast<const VariableExprNode *>(&lhs)) {
+    return var->varName() ==
+           static_cast<const VariableExprNode &>(rhs).varName();
+  }
+  if (auto *bin = dynamic_cast<const BinaryExprNode *>(&lhs)) {
+    // Compare chains of operators down their lhs in a loop
+    auto *rhsBin = static_cast<const BinaryExprNode *>(&rhs);
+    for (;;) {
+      if (bin->opChar() != rhsBin->opChar() ||
+          !structurallyEqual(*bin->rhs(), *rhsBin->rhs())) {
+        return false;
+      }
+      auto *lhsNext = dynamic_cast<const BinaryExprNode *>(bin->lhs());
+      auto *rhsNext = dynamic_cast<const BinaryExprNode *>(rhsBin->lhs());
+      if (!lhsNext || !rhsNext) {
+        return structurallyEqual(*bin->lhs(), *rhsBin->lhs());
+      }
+      bin = lhsNext;
+      rhsBin = rhsNext;
+    }
+  }
+  if (auto *call = dynamic_cast<const CallExprNode *>(&lhs)) {
+    auto &rhsCall = static_cast<const CallExprNode &>(rhs);
+    if (call->callee() != rhsCall.callee() ||
+        call->args().size() != rhsCall.args().size()) {
+      return false;
+    }
+    for (size_t i = 0; i < call->args().size(); ++i) {
+      if (!structurallyEqual(*call->args()[i], *rhsCall.args()[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+  if (auto *index = dynamic_cast<const IndexExprNode *>(&lhs)) {
+    auto &rhsIndex = static_cast<const IndexExprNode &>(rhs);
+    if (index->buffer() != rhsIndex.buffer() ||
+        !structurallyEqual(*index->index(), *rhsIndex.index()) ||
+        !index->value() != !rhsIndex.value()) {
+      return false;
+    }
+    return !index->value() ||
+           structurallyEqual(*index->value(), *rhsIndex.value());
+  }
+  if (auto *ifelse = dynamic_cast<const IfElseExprNode *>(&lhs)) {
+    auto &rhsIfElse = static_cast<const IfElseExprNode &>(rhs);
+    return structurallyEqual(*ifelse->condExpr(), *rhsIfElse.condExpr()) &&
+           structurallyEqual(*ifelse->thenExpr(), *rhsIfElse.thenExpr()) &&
+           structurallyEqual(*ifelse->elseExpr(), *rhsIfElse.elseExpr());
+  }
+  return false;
+}
+
+std::string canonicalForm(FunctionNode &funcNode) {
+  CanonicalWriter writer(funcNode.args());
+  funcNode.accept(writer);
+  return std::move(writer.str());
+}
@@ -0,0 +1,53 @@
+#ifndef STRUCTHASH_H
+#define STRUCTHASH_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ast.h"
+#include "visitor.h"
+
+// Computes a structural hash for every expression of a function body,
+// bottom-up in a single walk. Parameters hash by their position rather than
+// their name, so alpha-equivalent expressions hash equal.
+class StructuralHasher : public Visitor {
+public:
+  struct Info {
+    uint64_t hash;
+    // False if the expression contains a call, whose callee may have side
+    // effects.
+    bool pure;
+  };
+
+  explicit StructuralHasher(const std::vector<std::string> &params);
+
+  const Info &info(const ExprNode &expr) const { return infos_.at(&expr); }
+
+  void visit(ExprNode &exprNode) override;
+  void visit(NumberExprNode &numExpr) override;
+  void visit(VariableExprNode &varExpr) override;
+  void visit(BinaryExprNode &binExpr) override;
+  void visit(CallExprNode &callExpr) override;
+  void visit(IfElseExprNode &ifelseExpr) override;
+  void visit(IndexExprNode &indexExpr) override;
+  void visit(FunctionNode &funcNode) override;
+
+private:
+  const Info &hashChild(ExprNode &expr);
+
+  std::unordered_map<std::string, unsigned> paramIndex_;
+  std::unordered_map<const ExprNode *, Info> infos_;
+};
+
+// Returns true if both expressions have the same structure and refer to the
+// same variables.
+bool structurallyEqual(const ExprNode &lhs, const ExprNode &rhs);
+
+// Returns an encoding of the function's arity and body in which parameters
+// are replaced by their position: two functions get the same encoding iff
+// their bodies are identical up to parameter renaming.
+std::string canonicalForm(FunctionNode &funcNode);
+
+#endif // STRUCTHASH_H
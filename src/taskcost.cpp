@@ -0,0 +1,100 @@
+#include <algorithm>
+
+#include "taskcost.h"
+
+TaskCostModel::TaskCostModel(const TaskInfos &infos, FunctionNode &funcNode)
+    : infos_(infos), name_(funcNode.name()), pure_(!funcNode.isDecl()) {
+  // Another call could write the same buffer
+  for (size_t i = 0; i < funcNode.args().size(); ++i) {
+    pure_ &= !funcNode.isBufferParam(i);
+  }
+  funcNode.accept(*this);
+}
+
+unsigned TaskCostModel::cost(const ExprNode &expr) const {
+  auto it = costs_.find(&expr);
+  return it == costs_.end() ? 1 : it->second;
+}
+
+bool TaskCostModel::shouldSpawn(const ExprNode &expr,
+                                unsigned restCost) const {
+  auto *callExpr = dynamic_cast<const CallExprNode *>(&expr);
+  if (!callExpr || restCost < kMinTaskCost) {
+    return false;
+  }
+  TaskInfo info = calleeInfo(callExpr->callee());
+  return info.pure && info.cost >= kMinTaskCost;
+}
+
+TaskInfo TaskCostModel::calleeInfo(const std::string &callee) const {
+  if (!name_.empty() && callee == name_) {
+    return TaskInfo{true, kUnboundedCost};
+  }
+  auto it = infos_.find(callee);
+  return it == infos_.end() ? TaskInfo() : it->second;
+}
+
+unsigned TaskCostModel::estimate(ExprNode &expr) {
+  expr.accept(*this);
+  return cost(expr);
+}
+
+void TaskCostModel::visit(ExprNode &exprNode) { assert(false); }
+
+void TaskCostModel::visit(NumberExprNode &numExpr) {}
+
+void TaskCostModel::visit(VariableExprNode &varExpr) {}
+
+void TaskCostModel::visit(BinaryExprNode &binExpr) {
+  auto chain = lhsChain(binExpr);
+  unsigned cost = estimate(*chain.back()->lhs());
+  for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+    BinaryExprNode &node = **it;
+    cost = addCost(1, addCost(cost, estimate(*node.rhs())));
+    if (node.op() == BinaryExprNode::Op::custom) {
+      TaskInfo info = calleeInfo(std::string("binary") + node.opChar());
+      pure_ &= info.pure;
+      cost = addCost(cost, info.cost);
+    }
+    costs_[&node] = cost;
+  }
+}
+
+void TaskCostModel::visit(CallExprNode &callExpr) {
+  TaskInfo info = calleeInfo(callExpr.callee());
+  pure_ &= info.pure;
+  unsigned cost = addCost(1, info.cost);
+  for (const auto &arg : callExpr.args()) {
+    cost = addCost(cost, estimate(*arg));
+  }
+  costs_[&callExpr] = cost;
+}
+
+void TaskCostModel::visit(IfElseExprNode &ifelseExpr) {
+  unsigned condCost = estimate(*ifelseExpr.condExpr());
+  unsigned thenCost = estimate(*ifelseExpr.thenExpr());
+  unsigned elseCost = estimate(*ifelseExpr.elseExpr());
+  costs_[&ifelseExpr] = addCost(1, addCost(condCost,
+                                           std::max(thenCost, elseCost)));
+}
+
+void TaskCostModel::visit(IndexExprNode &indexExpr) {
+  unsigned cost = addCost(1, estimate(*indexExpr.index()));
+  if (indexExpr.value()) {
+    pure_ = false;
+    cost = addCost(cost, estimate(*indexExpr.value()));
+  }
+  costs_[&indexExpr] = cost;
+}
+
+void TaskCostModel::visit(FunctionNode &funcNode) {
+  if (funcNode.body()) {
+    funcNode.body()->accept(*this);
+  }
+}
+
+void analyzeTaskInfo(FunctionNode &funcNode, TaskInfos &infos) {
+  TaskCostModel model(infos, funcNode);
+  infos[funcNode.name()] =
+      TaskInfo{model.pure(), addCost(1, model.cost(*funcNode.body()))};
+}
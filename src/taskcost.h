@@ -0,0 +1,67 @@
+#ifndef TASKCOST_H
+#define TASKCOST_H
+
+#include <limits>
+#include <string>
+#include <unordered_map>
+
+#include "ast.h"
+#include "visitor.h"
+
+// Cost of evaluating an expression, estimated in AST nodes
+constexpr unsigned kUnboundedCost = std::numeric_limits<unsigned>::max();
+// Cost from which a call is worth running as a task, when as much work is
+// left to do meanwhile
+constexpr unsigned kMinTaskCost = 200;
+
+inline unsigned addCost(unsigned a, unsigned b) {
+  return a > kUnboundedCost - b ? kUnboundedCost : a + b;
+}
+
+// What -fparallel-calls knows about a function
+struct TaskInfo {
+  // Neither writes memory nor does I/O, so its calls may run concurrently
+  // with anything: it has no buffer params and only calls pure functions
+  bool pure = false;
+  // Cost of a call, kUnboundedCost if it may recurse
+  unsigned cost = 1;
+};
+
+using TaskInfos = std::unordered_map<std::string, TaskInfo>;
+
+// Estimates the cost of the expressions of a function body and finds the
+// calls worth running as tasks. Calls to unknown functions are impure.
+class TaskCostModel : public Visitor {
+public:
+  TaskCostModel(const TaskInfos &infos, FunctionNode &funcNode);
+
+  bool pure() const { return pure_; }
+  unsigned cost(const ExprNode &expr) const;
+  // Returns true if `expr` is a call to a pure function expensive enough to
+  // run as a task while work costing `restCost` is done
+  bool shouldSpawn(const ExprNode &expr, unsigned restCost) const;
+
+  void visit(ExprNode &exprNode) override;
+  void visit(NumberExprNode &numExpr) override;
+  void visit(VariableExprNode &varExpr) override;
+  void visit(BinaryExprNode &binExpr) override;
+  void visit(CallExprNode &callExpr) override;
+  void visit(IfElseExprNode &ifelseExpr) override;
+  void visit(IndexExprNode &indexExpr) override;
+  void visit(FunctionNode &funcNode) override;
+
+private:
+  unsigned estimate(ExprNode &expr);
+  TaskInfo calleeInfo(const std::string &callee) const;
+
+  const TaskInfos &infos_;
+  std::string name_;
+  bool pure_;
+  std::unordered_map<const ExprNode *, unsigned> costs_;
+};
+
+// Adds the TaskInfo of the function defined by `funcNode` to `infos`.
+// Recursive calls are assumed pure.
+void analyzeTaskInfo(FunctionNode &funcNode, TaskInfos &infos);
+
+#endif // TASKCOST_H
@@ -6,6 +6,7 @@ class VariableExprNode;
 class BinaryExprNode;
 class CallExprNode;
 class IfElseExprNode;
+class IndexExprNode;
 class FunctionNode;
 
 class Visitor {
@@ -16,5 +17,6 @@ public:
   virtual void visit(BinaryExprNode &) = 0;
   virtual void visit(CallExprNode &) = 0;
   virtual void visit(IfElseExprNode &) = 0;
+  virtual void visit(IndexExprNode &) = 0;
   virtual void visit(FunctionNode &) = 0;
 };